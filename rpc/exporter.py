@@ -0,0 +1,351 @@
+#!/usr/bin/env python3
+'''Prometheus exporter for an XMM7360 modem.
+
+Driver counters (netdev and ethtool statistics, TD ring occupancy, IRQ and
+doorbell counts) are read on every scrape; they come from sysfs and an
+ethtool ioctl and never touch the data path beyond a short spinlock.
+
+Radio metrics are sampled over RPC by a background thread on its own
+session of the RPC device, so a slow or unanswered call only makes those
+metrics go stale. Their age is exported so that shows up.
+'''
+
+import collections
+import contextlib
+import ctypes
+import fcntl
+import http.server
+import json
+import os
+import select
+import socket
+import struct
+import threading
+import time
+from os.path import join, abspath, dirname
+
+import rpc
+import rpc_unsol_table
+
+SIOCETHTOOL = 0x8946
+ETHTOOL_GDRVINFO = 0x03
+ETHTOOL_GSTRINGS = 0x1b
+ETHTOOL_GSTATS = 0x1d
+ETH_SS_STATS = 1
+ETH_GSTRING_LEN = 32
+# offset of n_stats in struct ethtool_drvinfo
+DRVINFO_N_STATS = 180
+DRVINFO_SIZE = 196
+
+STATES = ('booting', 'ready', 'crashed', 'error', 'suspended')
+
+Ring = collections.namedtuple('Ring', 'depth wptr rptr tds bytes')
+
+
+def read_sysfs(path, default=None):
+    try:
+        with open(path) as f:
+            return f.read().strip()
+    except OSError:
+        return default
+
+
+def parse_rings(text):
+    '''Parse the driver's rings attribute into {ring number: Ring}'''
+    rings = {}
+    for line in text.splitlines():
+        fields = list(map(int, line.split()))
+        # drivers before the traffic counters print four columns
+        fields += [0] * (6 - len(fields))
+        rings[fields[0]] = Ring(*fields[1:6])
+    return rings
+
+
+def ring_fill(ring):
+    '''TDs handed to the modem and not yet returned. On a Tx ring that is
+    queued uplink data, on an Rx ring the buffers posted for downlink.'''
+    return (ring.wptr - ring.rptr) & (ring.depth - 1)
+
+
+class DriverStats(object):
+    def __init__(self, ifname):
+        self.ifname = ifname
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.netdir = join('/sys/class/net', ifname)
+        self.devdir = join(self.netdir, 'device')
+
+    def _ethtool(self, buf):
+        ifr = struct.pack('16sP', self.ifname.encode(), ctypes.addressof(buf))
+        fcntl.ioctl(self.sock, SIOCETHTOOL, ifr.ljust(40, b'\0'))
+
+    def ethtool_stats(self):
+        drvinfo = ctypes.create_string_buffer(
+            struct.pack('<L', ETHTOOL_GDRVINFO), DRVINFO_SIZE)
+        self._ethtool(drvinfo)
+        n = struct.unpack_from('<L', drvinfo, DRVINFO_N_STATS)[0]
+
+        strings = ctypes.create_string_buffer(
+            struct.pack('<LLL', ETHTOOL_GSTRINGS, ETH_SS_STATS, n),
+            12 + n * ETH_GSTRING_LEN)
+        self._ethtool(strings)
+        stats = ctypes.create_string_buffer(
+            struct.pack('<LL', ETHTOOL_GSTATS, n), 8 + n * 8)
+        self._ethtool(stats)
+
+        names = []
+        for i in range(n):
+            off = 12 + i * ETH_GSTRING_LEN
+            name = strings.raw[off:off + ETH_GSTRING_LEN]
+            names.append(name.split(b'\0')[0].decode())
+        return dict(zip(names, struct.unpack_from('<%dQ' % n, stats, 8)))
+
+    def rings(self):
+        return parse_rings(read_sysfs(join(self.devdir, 'rings'), ''))
+
+    def device_counter(self, name):
+        value = read_sysfs(join(self.devdir, name))
+        return None if value is None else int(value)
+
+    def netdev_stats(self):
+        statdir = join(self.netdir, 'statistics')
+        stats = {}
+        for name in os.listdir(statdir):
+            value = read_sysfs(join(statdir, name))
+            if value is not None:
+                stats[name] = int(value)
+        return stats
+
+    def collect(self, m):
+        for name, value in sorted(self.netdev_stats().items()):
+            m.add('xmm7360_netdev_' + name, 'counter', value)
+        try:
+            for name, value in self.ethtool_stats().items():
+                m.add('xmm7360_driver_' + name, 'gauge'
+                      if name.startswith('sojourn_') else 'counter', value)
+        except OSError:
+            pass
+
+        state = read_sysfs(join(self.devdir, 'state'))
+        for s in STATES:
+            m.add('xmm7360_state', 'gauge', int(s == state), state=s)
+        asleep = read_sysfs(join(self.devdir, 'asleep'))
+        if asleep is not None:
+            m.add('xmm7360_asleep', 'gauge', int(asleep))
+        policy = read_sysfs(join(self.netdir, 'xmm7360', 'coalesce_policy'))
+        if policy is not None:
+            m.add('xmm7360_coalesce_policy', 'gauge', 1, policy=policy)
+
+        for name in ('irqs', 'doorbells'):
+            value = self.device_counter(name)
+            if value is not None:
+                m.add('xmm7360_' + name, 'counter', value)
+
+        for num, ring in sorted(self.rings().items()):
+            labels = {'qp': str(num // 2), 'dir': 'rx' if num & 1 else 'tx'}
+            m.add('xmm7360_ring_depth', 'gauge', ring.depth, **labels)
+            m.add('xmm7360_ring_fill', 'gauge', ring_fill(ring), **labels)
+            m.add('xmm7360_ring_tds', 'counter', ring.tds, **labels)
+            m.add('xmm7360_ring_bytes', 'counter', ring.bytes, **labels)
+
+
+class RadioSampler(threading.Thread):
+    '''Polls the modem over RPC every interval seconds and keeps the last
+    answers for the scrape handler.'''
+
+    def __init__(self, path, interval, timeout=5):
+        super().__init__(daemon=True)
+        self.path = path
+        self.interval = interval
+        self.timeout = timeout
+        self.lock = threading.Lock()
+        self.ip = None
+        self.signal = None
+        self.sampled = None
+        self.errors = 0
+
+    def wait_unsolicited(self, r, name, deadline):
+        while True:
+            left = deadline - time.monotonic()
+            if left <= 0 or not select.select([r.fp], [], [], left)[0]:
+                return None
+            msg = r.pump()
+            if msg['type'] != 'unsolicited':
+                continue
+            got = rpc_unsol_table.xmm7360_unsol.get(msg['code'])
+            if got == 'UtaMsNetRadioSignalIndCb' or got == name:
+                return msg
+
+    def sample(self, r):
+        ip, _ = rpc.get_ip(r)
+        r.execute('UtaMsNetSingleShotRadioSignalReportingReq')
+        msg = self.wait_unsolicited(
+            r, 'UtaMsNetSingleShotRadioSignalReportingRspCb',
+            time.monotonic() + self.timeout)
+        signal = None
+        if msg is not None:
+            signal = [v for v in msg['content'] if isinstance(v, int)]
+
+        with self.lock:
+            self.ip = ip
+            if signal is not None:
+                self.signal = signal
+            self.sampled = time.monotonic()
+
+    def run(self):
+        r = None
+        while True:
+            try:
+                # rpc.py reports every message on stdout
+                with open(os.devnull, 'w') as null, \
+                        contextlib.redirect_stdout(null):
+                    if r is None:
+                        r = rpc.XMMRPC(self.path)
+                        r.set_unsol_filter((
+                            'UtaMsNetIsAttachAllowedIndCb',
+                            'UtaMsNetRadioSignalIndCb',
+                            'UtaMsNetSingleShotRadioSignalReportingRspCb'))
+                    self.sample(r)
+            except (OSError, AssertionError):
+                with self.lock:
+                    self.errors += 1
+                if r is not None:
+                    os.close(r.fp)
+                    r = None
+            time.sleep(self.interval)
+
+    def collect(self, m):
+        with self.lock:
+            m.add('xmm7360_rpc_sample_errors', 'counter', self.errors)
+            if self.sampled is None:
+                return
+            m.add('xmm7360_rpc_sample_age_seconds', 'gauge',
+                  round(time.monotonic() - self.sampled, 3))
+            m.add('xmm7360_attached', 'gauge', int(self.ip is not None))
+            if self.ip is not None:
+                m.add('xmm7360_ip_info', 'gauge', 1, address=self.ip)
+            # field meanings are not known, so export them by position
+            for i, value in enumerate(self.signal or []):
+                m.add('xmm7360_radio_signal_field', 'gauge', value,
+                      field=str(i))
+
+
+def collect_supervisor(m, path):
+    try:
+        with open(path) as f:
+            state = json.load(f)
+    except (OSError, ValueError):
+        return
+    m.add('xmm7360_supervisor_connected', 'gauge', int(state['connected']))
+    m.add('xmm7360_supervisor_reconnects', 'counter', state['reconnects'])
+    if state.get('last_reconnect_seconds') is not None:
+        m.add('xmm7360_supervisor_last_reconnect_seconds', 'gauge',
+              state['last_reconnect_seconds'])
+    m.add('xmm7360_supervisor_connected_since_seconds', 'gauge',
+          state['connected_since'])
+
+
+class Metrics(object):
+    '''Builds the Prometheus text exposition format'''
+
+    def __init__(self):
+        self.families = {}
+
+    def add(self, name, kind, value, **labels):
+        if kind == 'counter' and not name.endswith('_total'):
+            name += '_total'
+        self.families.setdefault(name, (kind, []))[1].append((labels, value))
+
+    def render(self):
+        out = []
+        for name, (kind, samples) in self.families.items():
+            family = name[:-len('_total')] if kind == 'counter' else name
+            out.append('# TYPE %s %s' % (family, kind))
+            for labels, value in samples:
+                if labels:
+                    label_text = ','.join(
+                        '%s="%s"' % (k, str(v).replace('\\', '\\\\')
+                                     .replace('"', '\\"'))
+                        for k, v in sorted(labels.items()))
+                    out.append('%s{%s} %s' % (name, label_text, value))
+                else:
+                    out.append('%s %s' % (name, value))
+        return '\n'.join(out) + '\n'
+
+
+def scrape(cfg, driver, sampler):
+    m = Metrics()
+    try:
+        driver.collect(m)
+    except OSError:
+        pass
+    if sampler is not None:
+        sampler.collect(m)
+    collect_supervisor(m, cfg.state_file)
+    return m.render()
+
+
+def write_textfile(path, text):
+    tmp = path + '.tmp'
+    with open(tmp, 'w') as f:
+        f.write(text)
+    os.replace(tmp, path)
+
+
+def main():
+    # only needed to run the exporter, not to import it
+    import configargparse
+
+    parser = configargparse.ArgumentParser(
+        description='Prometheus exporter for XMM7x60 modems',
+        default_config_files=[
+            '/etc/xmm7360',
+            join(dirname(abspath(__file__)), '..', 'xmm7360.ini')
+        ],
+    )
+    parser.add_argument('-c', '--conf', is_config_file=True)
+    parser.add_argument('--interface', default='wwan0')
+    parser.add_argument('--rpc-device', default='/dev/xmm0/rpc')
+    parser.add_argument('--rpc-interval', type=float, default=30,
+                        help="Seconds between radio samples over RPC, 0 to disable")
+    parser.add_argument('--listen', default='127.0.0.1:9743',
+                        help="Address to serve /metrics on")
+    parser.add_argument('--textfile',
+                        help="Write metrics to this file instead of serving them")
+    parser.add_argument('--textfile-interval', type=float, default=15)
+    parser.add_argument('--state-file', default='/run/xmm7360/supervisor.json',
+                        help="State file written by open_xdatachannel.py --supervise")
+    cfg, unknown = parser.parse_known_args()
+
+    driver = DriverStats(cfg.interface)
+    sampler = None
+    if cfg.rpc_interval > 0:
+        sampler = RadioSampler(cfg.rpc_device, cfg.rpc_interval)
+        sampler.start()
+
+    if cfg.textfile:
+        while True:
+            write_textfile(cfg.textfile, scrape(cfg, driver, sampler))
+            time.sleep(cfg.textfile_interval)
+
+    class Handler(http.server.BaseHTTPRequestHandler):
+        def do_GET(self):
+            if self.path != '/metrics':
+                self.send_error(404)
+                return
+            body = scrape(cfg, driver, sampler).encode()
+            self.send_response(200)
+            self.send_header('Content-Type',
+                             'text/plain; version=0.0.4; charset=utf-8')
+            self.send_header('Content-Length', str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+
+        def log_message(self, fmt, *args):
+            pass
+
+    host, port = cfg.listen.rsplit(':', 1)
+    http.server.HTTPServer((host, int(port)), Handler).serve_forever()
+
+
+if __name__ == '__main__':
+    main()
@@ -2,68 +2,179 @@
 
 import os
 import binascii
+import fcntl
 import struct
-import pytap2
 import selectors
+import time
+
+# _IOC(_IOC_READ, 'x', 0xc0, sizeof(uint32_t))
+XMM7360_IOCTL_GET_PAGE_SIZE = 2 << 30 | 4 << 16 | 0x78c0
+
+# tag, unknown, sequence, length, extra, next
+FIRST_HEADER = struct.Struct('<4sHHHHL')
+# tag, length, extra, next
+NEXT_HEADER = struct.Struct('<4sHHL')
+# offset, length
+BOUNDS = struct.Struct('<LL')
+# zeroes ahead of each uplink packet, as mux.c sends
+PACKET_PAD = 16
+
+
+class MuxFrame(object):
+    '''A mux frame built in place in a preallocated buffer, the way mux.c
+    does it. Appends return False when the frame has no room left.'''
+
+    def __init__(self, max_frame, max_packets=None):
+        self.max_frame = max_frame
+        self.max_packets = max_packets or max(max_frame // 1024, 1)
+        self.data = bytearray(max_frame)
+        self.view = memoryview(self.data)
+        self.seq = 0
+        self.bounds = []
+        self.init()
 
-
-class MuxPacket(object):
-    def __init__(self, seq=0):
-        self.seq = seq
-        self.packet = b''
-        self.fwd_pointer = None
-
-    def get_packet(self):
-        # put the final length in
-        self.packet = self.packet[:8] + \
-            struct.pack('<L', len(self.packet)) + self.packet[8 + 4:]
-        return self.packet
+    def init(self):
+        self.n_bytes = 0
+        # offsets of the length and next fields of the last tag
+        self.last_length = None
+        self.last_next = None
+        self.bounds.clear()
+        self.deadline = None
 
     def append_tag(self, tag, data=b'', extra=0):
-        hdr = tag
-
-        if self.packet == b'':  # first tag gets a sequence number
-            hdr += struct.pack('<HH', 0, self.seq)
+        first = self.n_bytes == 0
+        hdr = FIRST_HEADER if first else NEXT_HEADER
+
+        pad = -self.n_bytes & 3
+        total = hdr.size + len(data)
+        if self.n_bytes + pad + total > self.max_frame:
+            return False
+        self.data[self.n_bytes:self.n_bytes + pad] = bytes(pad)
+        self.n_bytes += pad
+
+        if self.last_next is not None:
+            struct.pack_into('<L', self.data, self.last_next, self.n_bytes)
+
+        if first:
+            FIRST_HEADER.pack_into(self.data, 0, tag, 0, self.seq, total,
+                                   extra, 0)
+            self.seq = (self.seq + 1) & 0xffff
+            self.last_length, self.last_next = 8, 12
         else:
-            while len(self.packet) & 3:
-                self.packet += b'\0'
-            self.packet = self.packet[:self.fwd_pointer] + struct.pack(
-                '<L', len(self.packet)) + self.packet[self.fwd_pointer + 4:]
-
-        hdr_len = len(hdr) + 8
-        hdr += struct.pack('<HHL', hdr_len + len(data), extra, 0)
-        # that last field is the next-tag pointer
-        self.fwd_pointer = len(self.packet) + len(hdr) - 4
-
-        self.packet += hdr + data
+            NEXT_HEADER.pack_into(self.data, self.n_bytes, tag, total,
+                                  extra, 0)
+            self.last_length = self.n_bytes + 4
+            self.last_next = self.n_bytes + 8
+        self.n_bytes += hdr.size
+
+        self.data[self.n_bytes:self.n_bytes + len(data)] = data
+        self.n_bytes += len(data)
+        return True
+
+    def _append_data(self, data):
+        '''Grow the last tag by data, which the caller has made room for'''
+        end = self.n_bytes + len(data)
+        self.data[self.n_bytes:end] = data
+        length, = struct.unpack_from('<H', self.data, self.last_length)
+        struct.pack_into('<H', self.data, self.last_length,
+                         length + len(data))
+        self.n_bytes = end
+
+    def append_packet(self, packet, coalesce=0):
+        '''Add an uplink packet to the ADBH tag. The frame is due coalesce
+        seconds after its first packet.'''
+        if len(self.bounds) >= self.max_packets:
+            return False
+        # the ADTH tag, aligned, with this packet's bounds
+        adth = 3 + NEXT_HEADER.size + 4 + (len(self.bounds) + 1) * BOUNDS.size
+        if self.n_bytes + PACKET_PAD + len(packet) + adth > self.max_frame:
+            return False
+
+        if not self.bounds:
+            self.deadline = time.monotonic() + coalesce
+        self.bounds.append((self.n_bytes, PACKET_PAD + len(packet)))
+        self._append_data(bytes(PACKET_PAD))
+        self._append_data(packet)
+        return True
+
+    def append_adth(self):
+        if not self.append_tag(b'ADTH', b'\0\0\0\0'):
+            return False
+        start = self.n_bytes
+        self._append_data(bytes(BOUNDS.size * len(self.bounds)))
+        for i, (offset, length) in enumerate(self.bounds):
+            BOUNDS.pack_into(self.data, start + i * BOUNDS.size, offset,
+                             length)
+        return True
+
+    def complete(self):
+        '''The finished frame. The first tag gets the total length.'''
+        struct.pack_into('<H', self.data, 8, self.n_bytes)
+        return self.view[:self.n_bytes]
+
+    def push(self, fd):
+        frame = self.complete()
+        ret = os.write(fd, frame)
+        if ret < len(frame):
+            print("mux write error: %d" % ret)
+        self.init()
+
+
+def parse_frame(view):
+    '''Yield the packets in a downlink frame, as memoryviews into it.
+    Frames that are cut short or malformed yield what they can.'''
+    if len(view) < FIRST_HEADER.size:
+        return
+    tag, _, _, _, _, nxt = FIRST_HEADER.unpack_from(view, 0)
+    if tag == b'ACBH':
+        # command replies, such as to the open sent at start
+        return
+    if tag != b'ADBH':
+        print("Unexpected tag %r" % bytes(tag))
+        return
+
+    if nxt + NEXT_HEADER.size > len(view):
+        return
+    tag, length, _, _ = NEXT_HEADER.unpack_from(view, nxt)
+    if tag != b'ADTH':
+        print("Unexpected ADTH tag %r" % bytes(tag))
+        return
+
+    start = nxt + NEXT_HEADER.size + 4
+    end = min(nxt + length, len(view))
+    for i in range(max(end - start, 0) // BOUNDS.size):
+        offset, length = BOUNDS.unpack_from(view, start + i * BOUNDS.size)
+        if offset + length <= len(view):
+            yield view[offset:offset + length]
 
 
 class XMMMux(object):
-    def package(self, packet_data):
-        self.seq = (self.seq + 1) & 0xff
-        p = MuxPacket(seq=self.seq)
-        packet_data = b'\0' * 16 + packet_data
-        p.append_tag(b'ADBH', packet_data)
-        p.append_tag(b'ADTH', struct.pack('<LLL', 0, 0x10, len(packet_data)))
-        # p.append_tag(b'QLTH', b'\0'*12)
-        pkt = p.get_packet()
-        return pkt
-
-    def __init__(self, path='/dev/xmm0/mux'):
+    def __init__(self, path='/dev/xmm0/mux', coalesce_us=100):
+        # only needed to run the mux, not to build frames
+        import pytap2
+
         self.fp = os.open(path, os.O_RDWR | os.O_SYNC)
 
-        self.seq = 0
+        page_size = bytearray(4)
+        fcntl.ioctl(self.fp, XMM7360_IOCTL_GET_PAGE_SIZE, page_size)
+        max_frame, = struct.unpack('<L', page_size)
+
+        self.frame = MuxFrame(max_frame)
+        self.coalesce = coalesce_us / 1e6
+        self.rx = bytearray(max_frame)
+        self.rx_view = memoryview(self.rx)
 
         pkd = binascii.unhexlify('414442480000010088000000700000006000000000383AFFFE800000000000000000000000000001FE80000000000000D438C1FD077C00C38600248840005550000000000000000005010000000005DC03044040FFFFFFFFFFFFFFFF0000000020018004142021F50000000000000000414454481800000000000000000000001000000060000000')
-        p = MuxPacket(seq=1)
+        p = MuxFrame(max_frame)
+        p.seq = 1
         p.append_tag(b'ADBH', binascii.unhexlify(
             '6000000000383AFFFE800000000000000000000000000001FE80000000000000D438C1FD077C00C38600248840005550000000000000000005010000000005DC03044040FFFFFFFFFFFFFFFF0000000020018004142021F50000000000000000'))
         p.append_tag(b'ADTH', struct.pack('<LLL', 0, 0x10, 0x60))
 
-        print(binascii.hexlify(p.get_packet()))
+        print(binascii.hexlify(p.complete()))
         print(binascii.hexlify(pkd))
 
-        assert pkd == p.get_packet()
+        assert pkd == p.complete()
 
         self.tun = pytap2.TapDevice(pytap2.TapMode.Tun)
         self.tun.up()
@@ -72,37 +183,43 @@ class XMMMux(object):
         sel.register(self.fp, selectors.EVENT_READ, self.read_mux)
         sel.register(self.tun, selectors.EVENT_READ, self.read_tun)
 
-        p = MuxPacket()
-        p.append_tag(b'ACBH')
-        p.append_tag(b'CMDH', struct.pack('<LLLL', 1, 0, 0, 0))
-        os.write(self.fp, p.get_packet())
+        self.frame.append_tag(b'ACBH')
+        self.frame.append_tag(b'CMDH', struct.pack('<LLLL', 1, 0, 0, 0))
+        self.frame.push(self.fp)
+
+        self.frame.append_tag(b'ADBH')
 
         while True:
-            events = sel.select()
+            timeout = None
+            if self.frame.bounds:
+                timeout = max(self.frame.deadline - time.monotonic(), 0)
+            events = sel.select(timeout)
             for key, mask in events:
                 callback = key.data
                 callback()
+            if self.frame.bounds and time.monotonic() >= self.frame.deadline:
+                self.flush()
+
+    def flush(self):
+        self.frame.append_adth()
+        self.frame.push(self.fp)
+        self.frame.append_tag(b'ADBH')
 
     def read_tun(self):
         packet = self.tun.read()
-        os.write(self.fp, self.package(packet))
+        if not self.frame.append_packet(packet, self.coalesce):
+            # frame was too full; try again
+            self.flush()
+            if not self.frame.append_packet(packet, self.coalesce):
+                print("could not write packet of %d bytes" % len(packet))
+                return
+        if len(self.frame.bounds) >= self.frame.max_packets:
+            self.flush()
 
     def read_mux(self):
-        data = os.read(self.fp, 8192)
-        if data.startswith(b'ADBH'):
-            unq, seq, length, sublen = struct.unpack('<HHLL', data[4:16])
-
-            tail = data[sublen:]
-
-            if tail.startswith(b'ADTH'):
-                length, unk = struct.unpack('<HH', tail[4:8])
-                tail = tail[16:]
-                while len(tail) >= 8:
-                    offset, length = struct.unpack('<LL', tail[:8])
-                    puk = data[offset:offset + length]
-                    # print('ai>', binascii.hexlify(puk))
-                    self.tun.write(puk)
-                    tail = tail[8:]
+        count = os.readv(self.fp, [self.rx])
+        for packet in parse_frame(self.rx_view[:count]):
+            self.tun.write(packet)
 
 
 if __name__ == "__main__":
@@ -3,6 +3,8 @@
 import configargparse
 from pyroute2 import IPRoute
 from os.path import join, abspath, dirname
+import json
+import os
 import uuid
 import socket
 import struct
@@ -11,6 +13,7 @@ import sys
 import time
 
 import rpc
+import rpc_unsol_table
 import logging
 # must do this before importing pyroute2
 logging.basicConfig(level=logging.DEBUG)
@@ -36,199 +39,401 @@ parser.add_argument('-r', '--noresolv', action="store_true",
                     help="Don't add modem-provided DNS servers to /etc/resolv.conf")
 parser.add_argument('-d', '--dbus', action="store_true",
                     help="Activate Networkmanager Connection via DBUS")
+parser.add_argument('--slow-rpc-ms', type=int, default=1000,
+                    help="Log RPC calls taking at least this long")
+parser.add_argument('--rpc-stats', action="store_true",
+                    help="Print per-call RPC latencies once connected")
+parser.add_argument('-s', '--supervise', action="store_true",
+                    help="Stay running and reconnect when the network drops us")
+parser.add_argument('--state-file', default='/run/xmm7360/supervisor.json',
+                    help="Where the supervisor records connection state")
 
 cfg, unknown = parser.parse_known_args()
 
-r = rpc.XMMRPC()
+r = rpc.XMMRPC(slow_call_ms=cfg.slow_rpc_ms)
 ipr = IPRoute()
 
-r.execute('UtaMsSmsInit')
-r.execute('UtaMsCbsInit')
-r.execute('UtaMsNetOpen')
-r.execute('UtaMsCallCsInit')
-r.execute('UtaMsCallPsInitialize')
-r.execute('UtaMsSsInit')
-r.execute('UtaMsSimOpenReq')
-
-rpc.do_fcc_unlock(r)
-# disable aeroplane mode if had been FCC-locked. first and second args are probably don't-cares
-rpc.UtaModeSet(r, 1)
-
-r.execute('UtaMsCallPsAttachApnConfigReq',
-          rpc.pack_UtaMsCallPsAttachApnConfigReq(cfg.apn), is_async=True)
+# Indications that the data connection has gone away
+LINK_LOST = ('UtaMsNetPsDetachIndCb', 'UtaMsCallPsDeactivateIndCb')
 
-attach = r.execute('UtaMsNetAttachReq',
-                   rpc.pack_UtaMsNetAttachReq(), is_async=True)
-_, status = rpc.unpack('nn', attach['body'])
+RESOLV_MARKER = '# Added by xmm7360'
 
-if status == 0xffffffff:
-    logging.info("Attach failed - waiting to see if we just weren't ready")
 
-    while not r.attach_allowed:
-        r.pump()
+def attach():
+    r.execute('UtaMsCallPsAttachApnConfigReq',
+              rpc.pack_UtaMsCallPsAttachApnConfigReq(cfg.apn), is_async=True)
 
     attach = r.execute('UtaMsNetAttachReq',
                        rpc.pack_UtaMsNetAttachReq(), is_async=True)
     _, status = rpc.unpack('nn', attach['body'])
 
     if status == 0xffffffff:
-        logging.error("Attach failed again, giving up")
-        sys.exit(1)
-
-while True:
-    ip_addr, dns_values = rpc.get_ip(r)
-    if ip_addr is not None:
-        break
-    interval = cfg.ip_fetch_timeout
-    logging.info(f"IP address couldn't be fetched, waiting {interval} seconds")
-    time.sleep(interval)
-
-logging.info("IP address: " + str(ip_addr))
-logging.info("DNS server(s): " + ', '.join(map(str, dns_values['v4'] + dns_values['v6'])))
-
-idx = ipr.link_lookup(ifname='wwan0')[0]
-
-ipr.flush_addr(index=idx)
-ipr.link('set',
-         index=idx,
-         state='up')
-ipr.addr('add',
-         index=idx,
-         address=ip_addr)
-
-
-if not cfg.nodefaultroute:
-    ipr.route('add',
-              dst='default',
-              priority=cfg.metric,
-              oif=idx)
-
-# Add DNS values to /etc/resolv.conf
-if not cfg.noresolv:
-    with open('/etc/resolv.conf', 'a') as resolv:
-        resolv.write('\n# Added by xmm7360\n')
-        for dns in dns_values['v4'] + dns_values['v6']:
-            resolv.write('nameserver %s\n' % dns)
-
-# this gives us way too much stuff, which we need
-pscr = r.execute('UtaMsCallPsConnectReq',
-                 rpc.pack_UtaMsCallPsConnectReq(), is_async=True)
-# this gives us a handle we need
-dcr = r.execute('UtaRPCPsConnectToDatachannelReq',
-                rpc.pack_UtaRPCPsConnectToDatachannelReq())
-
-csr_req = pscr['body'][:-6] + dcr['body'] + b'\x02\x04\0\0\0\0'
-
-r.execute('UtaRPCPSConnectSetupReq', csr_req)
-
-if not cfg.dbus:
-    sys.exit(1)
+        logging.info("Attach failed - waiting to see if we just weren't ready")
+
+        while not r.attach_allowed:
+            r.pump()
+
+        attach = r.execute('UtaMsNetAttachReq',
+                           rpc.pack_UtaMsNetAttachReq(), is_async=True)
+        _, status = rpc.unpack('nn', attach['body'])
+
+        if status == 0xffffffff:
+            raise IOError("Attach failed again, giving up")
+
+
+def fetch_ip():
+    while True:
+        ip_addr, dns_values = rpc.get_ip(r)
+        if ip_addr is not None:
+            return ip_addr, dns_values
+        interval = cfg.ip_fetch_timeout
+        logging.info(f"IP address couldn't be fetched, waiting {interval} seconds")
+        time.sleep(interval)
+
+
+def update_resolv(servers, path='/etc/resolv.conf'):
+    '''Replace the nameservers added by an earlier connect with these'''
+    try:
+        with open(path) as f:
+            lines = f.read().splitlines()
+    except FileNotFoundError:
+        lines = []
+
+    kept = []
+    ours = False
+    for line in lines:
+        if line == RESOLV_MARKER:
+            ours = True
+            # and the blank line written ahead of it
+            if kept and not kept[-1]:
+                kept.pop()
+            continue
+        if ours and line.startswith('nameserver '):
+            continue
+        ours = False
+        kept.append(line)
+
+    kept += ['', RESOLV_MARKER] + ['nameserver %s' % dns for dns in servers]
+    # rewritten in place, as it is often a symlink
+    with open(path, 'w') as f:
+        f.write('\n'.join(kept) + '\n')
+
+
+def configure_ip(ip_addr, dns_values):
+    logging.info("IP address: " + str(ip_addr))
+    logging.info("DNS server(s): " + ', '.join(map(str, dns_values['v4'] + dns_values['v6'])))
+
+    idx = ipr.link_lookup(ifname='wwan0')[0]
+
+    ipr.flush_addr(index=idx)
+    ipr.link('set',
+             index=idx,
+             state='up')
+    ipr.addr('add',
+             index=idx,
+             address=ip_addr)
+
+    if not cfg.nodefaultroute:
+        ipr.route('replace',
+                  dst='default',
+                  priority=cfg.metric,
+                  oif=idx)
+
+    # Add DNS values to /etc/resolv.conf
+    if not cfg.noresolv:
+        update_resolv(dns_values['v4'] + dns_values['v6'])
+
+
+def connect_datachannel():
+    # this gives us way too much stuff, which we need
+    pscr = r.execute('UtaMsCallPsConnectReq',
+                     rpc.pack_UtaMsCallPsConnectReq(), is_async=True)
+    # this gives us a handle we need
+    dcr = r.execute('UtaRPCPsConnectToDatachannelReq',
+                    rpc.pack_UtaRPCPsConnectToDatachannelReq())
+
+    csr_req = pscr['body'][:-6] + dcr['body'] + b'\x02\x04\0\0\0\0'
+
+    r.execute('UtaRPCPSConnectSetupReq', csr_req)
+
+
+def write_state(state):
+    if not cfg.state_file:
+        return
+    try:
+        os.makedirs(dirname(cfg.state_file), exist_ok=True)
+        tmp = cfg.state_file + '.tmp'
+        with open(tmp, 'w') as f:
+            json.dump(state, f)
+        os.replace(tmp, cfg.state_file)
+    except OSError as e:
+        logging.warning("Can't write %s: %s" % (cfg.state_file, e))
+
+
+def reconnect(ip_addr, dns_values):
+    '''Bring the data connection back on the live RPC session. Only the
+    attach, PS connect and datachannel setup are repeated; the address
+    is reprogrammed only if the network handed out a different one.'''
+    delay = 1
+    while True:
+        try:
+            attach()
+            new_ip, new_dns = fetch_ip()
+            if (new_ip, new_dns) != (ip_addr, dns_values):
+                configure_ip(new_ip, new_dns)
+                if cfg.dbus:
+                    nm_setup(new_ip, new_dns)
+            connect_datachannel()
+            return new_ip, new_dns
+        except IOError as e:
+            logging.warning("Reconnect failed (%s), retrying in %d s" %
+                            (e, delay))
+            time.sleep(delay)
+            delay = min(delay * 2, 60)
+
+
+def supervise(ip_addr, dns_values):
+    # nothing else needs waking up for
+    r.set_unsol_filter(LINK_LOST + ('UtaMsNetIsAttachAllowedIndCb',
+                                    'UtaModeSetRspCb'))
+
+    state = {'ip': ip_addr, 'connected': True,
+             'connected_since': time.time(), 'reconnects': 0,
+             'last_reconnect_seconds': None}
+    write_state(state)
+
+    while True:
+        msg = r.pump()
+        if msg['type'] != 'unsolicited':
+            continue
+        name = rpc_unsol_table.xmm7360_unsol.get(msg['code'])
+        if name not in LINK_LOST:
+            continue
+
+        logging.warning("Connection lost (%s), reconnecting" % name)
+        state['connected'] = False
+        write_state(state)
 
-myconnection = None
-system_bus = dbus.SystemBus()
-service_name = "org.freedesktop.NetworkManager"
-proxy = system_bus.get_object(
-    service_name, "/org/freedesktop/NetworkManager/Settings")
-dproxy = system_bus.get_object(service_name, "/org/freedesktop/NetworkManager")
-settings = dbus.Interface(proxy, "org.freedesktop.NetworkManager.Settings")
-manager = dbus.Interface(dproxy, "org.freedesktop.NetworkManager")
+        start = time.monotonic()
+        ip_addr, dns_values = reconnect(ip_addr, dns_values)
+        elapsed = time.monotonic() - start
+        r.stats.record('reconnect', 'total', elapsed)
+        logging.info("Reconnected in %.2f s" % elapsed)
+
+        state.update(ip=ip_addr, connected=True, connected_since=time.time(),
+                     reconnects=state['reconnects'] + 1,
+                     last_reconnect_seconds=elapsed)
+        write_state(state)
+
+
+NM_SERVICE = "org.freedesktop.NetworkManager"
+NM_SETTINGS = "org.freedesktop.NetworkManager.Settings"
+NM_CONNECTION = "org.freedesktop.NetworkManager.Settings.Connection"
+NM_DEVICE = "org.freedesktop.NetworkManager.Device"
+DBUS_PROPERTIES = "org.freedesktop.DBus.Properties"
+# NMSettingsUpdate2Flags
+NM_UPDATE2_TO_DISK = 0x1
 
 
 def dottedQuadToNum(ip):
     return struct.unpack('<L', socket.inet_aton(str(ip)))[0]
 
 
-def get_connections():
-    global myconnection, connection_path
-    connection_paths = settings.ListConnections()
-    for path in connection_paths:
-        con_proxy = system_bus.get_object(service_name, path)
-        settings_connection = dbus.Interface(
-            con_proxy, "org.freedesktop.NetworkManager.Settings.Connection")
-        config = settings_connection.GetSettings()
-        s_con = config["connection"]
-        print("name:%s uuid:%s type:%s" %
-              (s_con["id"], s_con["uuid"], s_con["type"]))
-        if s_con["id"] == 'xmm7360':
-            myconnection = s_con["uuid"]
-            connection_path = path
-
-
-get_connections()
-
-if (myconnection is not None):
-    print("setup %s" % myconnection)
-    addr = dbus.Dictionary({"address": ip_addr, "prefix": dbus.UInt32(32)})
-    connection_paths = settings.ListConnections()
-    for path in connection_paths:
-        con_proxy = system_bus.get_object(service_name, path)
-        settings_connection = dbus.Interface(
-            con_proxy, "org.freedesktop.NetworkManager.Settings.Connection")
-        config = settings_connection.GetSettings()
-        if config["connection"]["uuid"] != myconnection:
-            continue
-        print("setup connection")
-        connection_path = path
-        if "addresses" in config["ipv4"]:
-            del config["ipv4"]["addresses"]
-        if "address-data" in config["ipv4"]:
-            del config["ipv4"]["address-data"]
-        if "gateway" in config["ipv4"]:
-            del config["ipv4"]["gateway"]
-        if "dns" in config["ipv4"]:
-            del config["ipv4"]["dns"]
-
-        addr = dbus.Dictionary(
-            {"address": ip_addr, "prefix": dbus.UInt32(32)}
-        )
-        config["ipv4"]["address-data"] = dbus.Array(
-            [addr], signature=dbus.Signature("a{sv}")
-        )
+class NetworkManager(object):
+    '''Keeps the xmm7360 connection in NetworkManager in step with the
+    modem. The connection and device are looked up once and then tracked
+    through D-Bus signals, so a reconnect costs an update and a reapply
+    rather than a walk over every saved connection.'''
+
+    def __init__(self, ifname='wwan0'):
+        self.ifname = ifname
+        try:
+            # signals are only delivered with a main loop to dispatch them
+            from dbus.mainloop.glib import DBusGMainLoop
+            from gi.repository import GLib
+            DBusGMainLoop(set_as_default=True)
+            self.context = GLib.MainContext.default()
+        except ImportError:
+            self.context = None
+        self.bus = dbus.SystemBus()
+        self.settings = dbus.Interface(
+            self.bus.get_object(NM_SERVICE,
+                                "/org/freedesktop/NetworkManager/Settings"),
+            NM_SETTINGS)
+        self.manager = dbus.Interface(
+            self.bus.get_object(NM_SERVICE, "/org/freedesktop/NetworkManager"),
+            NM_SERVICE)
+
+        self.connection_path = None
+        self.config = None
+        self.device_path = None
+
+        self.bus.add_signal_receiver(self.connection_removed,
+                                     "ConnectionRemoved", NM_SETTINGS)
+        self.bus.add_signal_receiver(self.connection_updated, "Updated",
+                                     NM_CONNECTION, path_keyword='path')
+        self.bus.add_signal_receiver(self.device_removed,
+                                     "DeviceRemoved", NM_SERVICE)
+
+    def connection_removed(self, path):
+        if path == self.connection_path:
+            self.connection_path = None
+            self.config = None
+
+    def connection_updated(self, path=None):
+        # refetched before our next update, so edits made elsewhere stick
+        if path == self.connection_path:
+            self.config = None
+
+    def device_removed(self, path):
+        if path == self.device_path:
+            self.device_path = None
+
+    def dispatch_signals(self):
+        if self.context is not None:
+            while self.context.pending():
+                self.context.iteration(False)
+
+    def connection(self):
+        return dbus.Interface(
+            self.bus.get_object(NM_SERVICE, self.connection_path),
+            NM_CONNECTION)
+
+    def find_connection(self):
+        for path in self.settings.ListConnections():
+            settings_connection = dbus.Interface(
+                self.bus.get_object(NM_SERVICE, path), NM_CONNECTION)
+            config = settings_connection.GetSettings()
+            s_con = config["connection"]
+            if s_con["id"] == 'xmm7360':
+                print("name:%s uuid:%s type:%s" %
+                      (s_con["id"], s_con["uuid"], s_con["type"]))
+                self.connection_path = path
+                self.config = config
+                return
+
+    def find_device(self):
+        self.device_path = self.manager.GetDeviceByIpIface(self.ifname)
+        prop_iface = dbus.Interface(
+            self.bus.get_object(NM_SERVICE, self.device_path), DBUS_PROPERTIES)
+        if not prop_iface.Get(NM_DEVICE, "Managed"):
+            print("activate")
+            prop_iface.Set(NM_DEVICE, "Managed", dbus.Boolean(1))
 
+    def ipv4_settings(self, ip_addr, dns_values):
+        addr = dbus.Dictionary({"address": ip_addr, "prefix": dbus.UInt32(32)})
         dbus_ip = [dottedQuadToNum(ip) for ip in dns_values['v4']]
-
-        config["ipv4"]["gateway"] = ip_addr
-
-        config["ipv4"]["dns"] = dbus.Array([dbus.UInt32(ip) for ip in dbus_ip],
-                                           signature=dbus.Signature("u")
-                                           )
-        settings_connection.Update(config)
-else:
-    print("adding connection")
-    n_con = dbus.Dictionary({"type": "generic", "uuid": str(
-        uuid.uuid4()), "id": "xmm7360", "interface-name": "wwan0"})
-    addr = dbus.Dictionary(
-        {"address": ip_addr, "prefix": dbus.UInt32(32)}
-    )
-
-    dbus_ip = [dottedQuadToNum(ip) for ip in dns_values['v4']]
-    n_ip4 = dbus.Dictionary(
-        {
+        return {
             "address-data": dbus.Array([addr], signature=dbus.Signature("a{sv}")),
             "gateway": ip_addr,
             "method": "manual",
-            "dns": dbus.Array([dbus.UInt32(ip) for ip in dbus_ip], signature=dbus.Signature("u"))
+            "dns": dbus.Array([dbus.UInt32(ip) for ip in dbus_ip], signature=dbus.Signature("u")),
         }
-    )
-    n_ip6 = dbus.Dictionary({"method": "ignore"})
-    add_con = dbus.Dictionary(
-        {"connection": n_con, "ipv4": n_ip4, "ipv6": n_ip6})
-    settings.AddConnection(add_con)
-    get_connections()
-
-devices = manager.GetDevices()
-
-for d in devices:
-    dev_proxy = system_bus.get_object("org.freedesktop.NetworkManager", d)
-    prop_iface = dbus.Interface(dev_proxy, "org.freedesktop.DBus.Properties")
-    props = prop_iface.GetAll("org.freedesktop.NetworkManager.Device")
-    if props["Interface"] == "wwan0":
-        devpath = d
-        print("found Interface: %s" % props["Interface"])
-        print("Managed: %s" % props["Managed"])
-        if props["Managed"] == 0:
-            print("activate")
-            prop_iface.Set("org.freedesktop.NetworkManager.Device",
-                           "Managed", dbus.Boolean(1))
 
-manager.ActivateConnection(connection_path, devpath, "/")
+    def add_connection(self, ip_addr, dns_values):
+        print("adding connection")
+        n_con = dbus.Dictionary({"type": "generic", "uuid": str(
+            uuid.uuid4()), "id": "xmm7360", "interface-name": self.ifname})
+        n_ip4 = dbus.Dictionary(self.ipv4_settings(ip_addr, dns_values))
+        n_ip6 = dbus.Dictionary({"method": "ignore"})
+        self.config = dbus.Dictionary(
+            {"connection": n_con, "ipv4": n_ip4, "ipv6": n_ip6})
+        self.connection_path = self.settings.AddConnection(self.config)
+
+    def update_connection(self, ip_addr, dns_values):
+        print("setup %s" % self.config["connection"]["uuid"])
+        ipv4 = self.config["ipv4"]
+        for key in ("addresses", "address-data", "gateway", "dns"):
+            ipv4.pop(key, None)
+        ipv4.update(self.ipv4_settings(ip_addr, dns_values))
+
+        settings_connection = self.connection()
+        try:
+            settings_connection.Update2(self.config, NM_UPDATE2_TO_DISK,
+                                        dbus.Dictionary({}, signature="sv"))
+        except dbus.exceptions.DBusException as e:
+            if not e.get_dbus_name().endswith('UnknownMethod'):
+                raise
+            # NetworkManager before 1.12
+            settings_connection.Update(self.config)
+
+    def activate(self):
+        device = dbus.Interface(
+            self.bus.get_object(NM_SERVICE, self.device_path), NM_DEVICE)
+        try:
+            # only the addresses have changed, which an active device
+            # can take without going down
+            device.Reapply(self.config, dbus.UInt64(0), dbus.UInt32(0))
+            return
+        except dbus.exceptions.DBusException:
+            pass
+        self.manager.ActivateConnection(self.connection_path,
+                                        self.device_path, "/")
+
+    def setup(self, ip_addr, dns_values):
+        self.dispatch_signals()
+        try:
+            self._setup(ip_addr, dns_values)
+        except dbus.exceptions.DBusException as e:
+            # an object we had cached went away without us hearing of it
+            logging.warning("NetworkManager: %s, looking up again" % e)
+            self.connection_path = self.config = self.device_path = None
+            self._setup(ip_addr, dns_values)
+
+    def _setup(self, ip_addr, dns_values):
+        if self.connection_path is None:
+            self.find_connection()
+        if self.connection_path is None:
+            self.add_connection(ip_addr, dns_values)
+        else:
+            if self.config is None:
+                self.config = self.connection().GetSettings()
+            self.update_connection(ip_addr, dns_values)
+
+        if self.device_path is None:
+            self.find_device()
+        self.activate()
+
+
+nm = None
+
+
+def nm_setup(ip_addr, dns_values):
+    global nm
+    if nm is None:
+        nm = NetworkManager()
+    nm.setup(ip_addr, dns_values)
+
+
+r.execute('UtaMsSmsInit')
+r.execute('UtaMsCbsInit')
+r.execute('UtaMsNetOpen')
+r.execute('UtaMsCallCsInit')
+r.execute('UtaMsCallPsInitialize')
+r.execute('UtaMsSsInit')
+r.execute('UtaMsSimOpenReq')
+
+rpc.do_fcc_unlock(r)
+# disable aeroplane mode if had been FCC-locked. first and second args are probably don't-cares
+rpc.UtaModeSet(r, 1)
+
+try:
+    attach()
+except IOError as e:
+    logging.error(str(e))
+    sys.exit(1)
+
+ip_addr, dns_values = fetch_ip()
+configure_ip(ip_addr, dns_values)
+connect_datachannel()
+
+if cfg.rpc_stats:
+    r.dump_stats()
+
+if cfg.dbus:
+    nm_setup(ip_addr, dns_values)
+
+if cfg.supervise:
+    supervise(ip_addr, dns_values)
+elif not cfg.dbus:
+    sys.exit(1)
@@ -2,26 +2,104 @@
 
 import os
 import binascii
+import bisect
+import collections
+import fcntl
 import struct
 import itertools
+import time
 import ipaddress
 import hashlib
 import rpc_call_ids
 import rpc_unsol_table
 
 
+# struct xmm7360_rpc_unsol_filter from xmm7360.h
+UNSOL_FILTER_CODES = 512
+_IOC_WRITE = 1
+XMM7360_IOCTL_RPC_UNSOL_FILTER = _IOC_WRITE << 30 | 64 << 16 | 0x78c5
+
+
+call_names = {cid: name for name, cid in rpc_call_ids.call_ids.items()}
+
+
+def call_name(cmd):
+    if isinstance(cmd, str):
+        return cmd
+    return call_names.get(cmd, '0x%x' % cmd)
+
+
+class CallStats(object):
+    '''Per-call latency histograms. Each call is timed from the request
+    write to its response, to its async ack, and optionally to a callback
+    indication; anything at or above slow_ms is logged as it happens.'''
+
+    BUCKETS_MS = (1, 2, 5, 10, 20, 50, 100, 200, 500,
+                  1000, 2000, 5000, 10000, 30000)
+
+    def __init__(self, slow_ms=None, log=print):
+        self.slow_ms = slow_ms
+        self.log = log
+        # (call name, phase) -> [count, total ms, max ms, bucket counts]
+        self.calls = {}
+
+    def record(self, name, phase, seconds):
+        ms = seconds * 1000
+        entry = self.calls.get((name, phase))
+        if entry is None:
+            entry = [0, 0.0, 0.0, [0] * (len(self.BUCKETS_MS) + 1)]
+            self.calls[(name, phase)] = entry
+        entry[0] += 1
+        entry[1] += ms
+        if ms > entry[2]:
+            entry[2] = ms
+        entry[3][bisect.bisect_left(self.BUCKETS_MS, ms)] += 1
+
+        if self.slow_ms is not None and ms >= self.slow_ms:
+            self.log('slow RPC: %s %s took %.1f ms' % (name, phase, ms))
+
+    def percentile(self, buckets, pct):
+        '''Upper bound of the bucket holding the pct'th percentile'''
+        wanted = sum(buckets) * pct / 100
+        seen = 0
+        for i, count in enumerate(buckets):
+            seen += count
+            if count and seen >= wanted:
+                if i < len(self.BUCKETS_MS):
+                    return '<=%d' % self.BUCKETS_MS[i]
+                return '>%d' % self.BUCKETS_MS[-1]
+        return '-'
+
+    def summary(self):
+        '''One line per call and phase, most total time first'''
+        lines = ['%-40s %-9s %6s %9s %9s %9s %9s' %
+                 ('call', 'phase', 'count', 'avg ms', 'max ms', 'p50', 'p90')]
+        entries = sorted(self.calls.items(), key=lambda kv: -kv[1][1])
+        for (name, phase), (count, total, worst, buckets) in entries:
+            lines.append('%-40s %-9s %6d %9.1f %9.1f %9s %9s' %
+                         (name, phase, count, total / count, worst,
+                          self.percentile(buckets, 50),
+                          self.percentile(buckets, 90)))
+        return '\n'.join(lines)
+
+
 def asn_int4(val):
     return b'\x02\x04' + struct.pack('>L', val)
 
 
 class XMMRPC(object):
-    def __init__(self, path='/dev/xmm0/rpc'):
+    def __init__(self, path='/dev/xmm0/rpc', slow_call_ms=None):
         self.fp = os.open(path, os.O_RDWR | os.O_SYNC)
 
+        self.stats = CallStats(slow_call_ms)
+        # async calls awaiting their ack, oldest first
+        self.pending_acks = collections.deque(maxlen=64)
+
         # loop over 1..255, excluding 0
         self.tid_gen = itertools.cycle(range(1, 256))
 
         self.attach_allowed = False
+        self.last_call = None
 
     def pump(self, is_async=False, have_ack=False, tid_word=None):
         message = os.read(self.fp, 131072)
@@ -29,6 +107,10 @@ class XMMRPC(object):
 
         desc = resp['type']
 
+        if resp['type'] == 'async_ack' and self.pending_acks:
+            name, start = self.pending_acks.popleft()
+            self.stats.record(name, 'async_ack', time.monotonic() - start)
+
         if resp['type'] == 'unsolicited':
             name = rpc_unsol_table.xmm7360_unsol.get(
                 resp['code'], '0x%02x' % resp['code'])
@@ -40,6 +122,7 @@ class XMMRPC(object):
 
     def execute(self, cmd, body=asn_int4(0), is_async=False):
         print("RPC executing %s" % cmd)
+        name = call_name(cmd)
         if isinstance(cmd, str):
             cmd = rpc_call_ids.call_ids[cmd]
 
@@ -61,6 +144,9 @@ class XMMRPC(object):
         assert total_length + 4 == len(header) + len(body)
 
         print(binascii.hexlify(header + body))
+        start = time.monotonic()
+        if is_async:
+            self.pending_acks.append((name, start))
         ret = os.write(self.fp, header + body)
         if ret < len(header + body):
             print("write error: %d", ret)
@@ -70,8 +156,13 @@ class XMMRPC(object):
             if resp['type'] == 'response':
                 break
 
+        self.stats.record(name, 'response', time.monotonic() - start)
+        self.last_call = (name, start)
         return resp
 
+    def dump_stats(self):
+        print(self.stats.summary())
+
     def handle_message(self, message):
         length = message[:4]
         len1_p = message[4:10]
@@ -107,6 +198,16 @@ class XMMRPC(object):
 
         return {'tid': txid, 'type': t, 'code': code, 'body': body, 'content': content}
 
+    def set_unsol_filter(self, names):
+        '''Have the driver drop unsolicited messages not named here.
+        Returns False if the driver can't filter.'''
+        try:
+            fcntl.ioctl(self.fp, XMM7360_IOCTL_RPC_UNSOL_FILTER,
+                        pack_unsol_filter(names))
+        except OSError:
+            return False
+        return True
+
     def handle_unsolicited(self, message):
         name = rpc_unsol_table.xmm7360_unsol.get(message['code'], None)
 
@@ -114,6 +215,16 @@ class XMMRPC(object):
             self.attach_allowed = message['content'][2]
 
 
+def pack_unsol_filter(names):
+    codes = {name: code for code, name in
+             rpc_unsol_table.xmm7360_unsol.items()}
+    words = [0] * (UNSOL_FILTER_CODES // 32)
+    for name in names:
+        code = codes[name]
+        words[code // 32] |= 1 << (code % 32)
+    return struct.pack('<%dL' % len(words), *words)
+
+
 def format_unknown(body):
     out = []
     for field in unpack_unknown(body):
@@ -337,11 +448,13 @@ def UtaModeSet(rpc, mode):
     resp = rpc.execute('UtaModeSetReq', pack('LLL', 0, mode_tid, mode))
     if resp['content'][0] != 0:
         raise IOError("UtaModeSet failed. Bad value?")
+    name, start = rpc.last_call
 
     while True:
         msg = rpc.pump()
         # msg['txid'] will be mode_tid as well
         if rpc_unsol_table.xmm7360_unsol.get(msg['code'], None) == 'UtaModeSetRspCb':
+            rpc.stats.record(name, 'callback', time.monotonic() - start)
             if msg['content'][0] != mode:
                 raise IOError(
                     "UtaModeSet was not able to set mode. FCC lock enabled?")
@@ -1,5 +1,11 @@
+import exporter
+import mux
 import rpc
+import rpc_unsol_table
+import xmmtop
 import binascii
+import os
+import struct
 
 
 def test_pack_UtaMsCallPsAttachApnConfigReq():
@@ -191,6 +197,140 @@ def test_pack_UtaMsCallPsConnectReq():
     assert rpc.pack_UtaMsCallPsConnectReq() == binascii.unhexlify(expected)
 
 
+def test_pack_unsol_filter():
+    packed = rpc.pack_unsol_filter(['UtaMsSimApduCmdRspCb',
+                                    'UtaMsNetIsAttachAllowedIndCb'])
+    words = struct.unpack('<16L', packed)
+    code = {name: code for code, name in
+            rpc_unsol_table.xmm7360_unsol.items()}[
+                'UtaMsNetIsAttachAllowedIndCb']
+    assert words[0] & (1 << 3)
+    assert words[code // 32] & (1 << (code % 32))
+    assert sum(bin(w).count('1') for w in words) == 2
+
+
+def test_call_stats():
+    slow = []
+    stats = rpc.CallStats(slow_ms=100, log=slow.append)
+    for seconds in [0.0005, 0.003, 0.003, 0.25]:
+        stats.record('UtaMsNetOpen', 'response', seconds)
+    count, total, worst, buckets = stats.calls[('UtaMsNetOpen', 'response')]
+    assert count == 4
+    assert worst == 250
+    assert stats.percentile(buckets, 50) == '<=5'
+    assert stats.percentile(buckets, 90) == '<=500'
+    assert len(slow) == 1 and 'UtaMsNetOpen' in slow[0]
+    assert 'UtaMsNetOpen' in stats.summary()
+    assert rpc.call_name(rpc.rpc_call_ids.call_ids['UtaMsNetOpen']) == \
+        'UtaMsNetOpen'
+
+
+def test_vectors_file():
+    # the same vectors drive test_xmmrpc.c
+    path = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                        'test_vectors.txt')
+    n = 0
+    with open(path) as vectors:
+        for line in vectors:
+            if line.startswith('#') or not line.strip():
+                continue
+            name, arg, expected = line.split()
+            args = [] if arg == '-' else [arg]
+            assert getattr(rpc, name)(*args) == binascii.unhexlify(expected)
+            n += 1
+    assert n == 5
+
+
+def test_exporter_metrics():
+    rings = exporter.parse_rings('2 128 5 3 10 4000\n3 128 1 2\n')
+    assert exporter.ring_fill(rings[2]) == 2
+    assert rings[2].bytes == 4000
+    # Rx ring with every buffer posted but one, across the wrap
+    assert exporter.ring_fill(rings[3]) == 127
+    assert rings[3].tds == 0
+
+    m = exporter.Metrics()
+    m.add('xmm7360_irqs', 'counter', 7)
+    m.add('xmm7360_ring_fill', 'gauge', 2, qp='1', dir='tx')
+    m.add('xmm7360_ip_info', 'gauge', 1, address='a"b')
+    assert m.render().splitlines() == [
+        '# TYPE xmm7360_irqs counter',
+        'xmm7360_irqs_total 7',
+        '# TYPE xmm7360_ring_fill gauge',
+        'xmm7360_ring_fill{dir="tx",qp="1"} 2',
+        '# TYPE xmm7360_ip_info gauge',
+        'xmm7360_ip_info{address="a\\"b"} 1',
+    ]
+
+
+def test_xmmtop():
+    class FakeDriver(object):
+        devdir = '/nonexistent'
+
+        def __init__(self, rings, irqs):
+            self._rings = exporter.parse_rings(rings)
+            self._irqs = irqs
+
+        def rings(self):
+            return self._rings
+
+        def device_counter(self, name):
+            return self._irqs if name == 'irqs' else 0
+
+        def ethtool_stats(self):
+            return {'tx_frames': 0, 'tx_frame_packets': 0}
+
+        def netdev_stats(self):
+            return {'rx_packets': 0}
+
+    prev = xmmtop.Sample(FakeDriver('0 16 0 0 0 0\n1 16 15 0 0 0\n', 0))
+    cur = xmmtop.Sample(FakeDriver('0 16 15 0 15 1500\n1 16 4 4 10 800\n',
+                                   10))
+    cur.time = prev.time + 1
+    lines = xmmtop.render(prev, cur, color=False)
+    assert 'irqs/s 10' in lines[0]
+    row = lines[3].split()
+    assert row[:2] == ['0', 'mux']
+    assert row[2:5] == ['1.5K', '15', '15/16']
+    assert row[5:8] == ['800', '10', '0/16']
+    assert row[8:] == ['TX', 'FULL', 'RX', 'EMPTY']
+
+
+def test_mux_frame():
+    frame = mux.MuxFrame(4096)
+    frame.seq = 7
+    assert frame.append_tag(b'ADBH')
+    packets = [b'\x45' * 20, b'\x60' * 41, b'\x45' * 1500]
+    for packet in packets:
+        assert frame.append_packet(packet)
+    assert not frame.append_packet(b'\x45' * 3000)
+    assert frame.append_adth()
+    data = bytes(frame.complete())
+
+    assert struct.unpack_from('<4sHHH', data) == (b'ADBH', 0, 7, len(data))
+    pad = b'\0' * mux.PACKET_PAD
+    assert [bytes(p) for p in mux.parse_frame(memoryview(data))] == \
+        [pad + packet for packet in packets]
+
+    # short reads, bad offsets and command replies yield nothing
+    assert list(mux.parse_frame(memoryview(data[:10]))) == []
+    assert list(mux.parse_frame(memoryview(data[:len(data) - 4]))) == \
+        [pad + packet for packet in packets[:2]]
+    bad_next = bytearray(data)
+    struct.pack_into('<L', bad_next, 12, len(data))
+    assert list(mux.parse_frame(memoryview(bad_next))) == []
+    frame.init()
+    assert frame.append_tag(b'ACBH')
+    assert frame.append_tag(b'CMDH', struct.pack('<LLLL', 1, 0, 0, 0))
+    assert list(mux.parse_frame(frame.complete())) == []
+
+    frame.init()
+    assert frame.append_tag(b'ADBH')
+    for i in range(frame.max_packets):
+        assert frame.append_packet(b'\x45' * 20)
+    assert not frame.append_packet(b'\x45' * 20)
+
+
 if __name__ == "__main__":
     print("running rpc tests")
     test_pack_UtaMsCallPsAttachApnConfigReq()
@@ -198,3 +338,9 @@ if __name__ == "__main__":
     test_pack_UtaMsNetAttachReq()
     test_pack_UtaMsCallPsGetNegIpAddrReq()
     test_pack_UtaMsCallPsConnectReq()
+    test_pack_unsol_filter()
+    test_call_stats()
+    test_vectors_file()
+    test_exporter_metrics()
+    test_xmmtop()
+    test_mux_frame()
@@ -0,0 +1,163 @@
+#include "xmmrpc.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failures;
+
+#define CHECK(cond)                                                            \
+	do {                                                                   \
+		if (!(cond)) {                                                 \
+			fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__,     \
+				#cond);                                        \
+			failures++;                                            \
+		}                                                              \
+	} while (0)
+
+static int unhex(const char *hex, uint8_t *out, size_t size)
+{
+	size_t i, len = strlen(hex) / 2;
+	unsigned int byte;
+
+	if (len > size)
+		return -1;
+	for (i = 0; i < len; i++) {
+		if (sscanf(hex + i * 2, "%2x", &byte) != 1)
+			return -1;
+		out[i] = byte;
+	}
+	return len;
+}
+
+static void pack_vector(const char *name, const char *arg,
+			struct xmmrpc_buf *b)
+{
+	if (!strcmp(name, "pack_UtaMsCallPsAttachApnConfigReq"))
+		xmmrpc_pack_UtaMsCallPsAttachApnConfigReq(b, arg);
+	else if (!strcmp(name, "pack_UtaRPCPsConnectToDatachannelReq"))
+		xmmrpc_pack_UtaRPCPsConnectToDatachannelReq(b, arg);
+	else if (!strcmp(name, "pack_UtaMsNetAttachReq"))
+		xmmrpc_pack_UtaMsNetAttachReq(b);
+	else if (!strcmp(name, "pack_UtaMsCallPsGetNegIpAddrReq"))
+		xmmrpc_pack_UtaMsCallPsGetNegIpAddrReq(b);
+	else if (!strcmp(name, "pack_UtaMsCallPsConnectReq"))
+		xmmrpc_pack_UtaMsCallPsConnectReq(b);
+	else
+		b->error = -ENOENT;
+}
+
+/* The request bodies rpc.py is tested against, from test_vectors.txt */
+static void test_vectors(const char *path)
+{
+	static char line[65536];
+	static uint8_t expected[32768];
+	char name[128], arg[128], hex[sizeof(line)];
+	struct xmmrpc_buf b;
+	int len, n = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	CHECK(f);
+	if (!f)
+		return;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "%127s %127s %65535s", name, arg, hex) != 3) {
+			CHECK(!"malformed vector");
+			continue;
+		}
+		len = unhex(hex, expected, sizeof(expected));
+		CHECK(len >= 0);
+
+		xmmrpc_buf_init(&b);
+		pack_vector(name, arg, &b);
+		if (b.error || b.len != (size_t)len ||
+		    memcmp(b.data, expected, len)) {
+			fprintf(stderr, "vector %s does not match\n", name);
+			failures++;
+		}
+		xmmrpc_buf_free(&b);
+		n++;
+	}
+	fclose(f);
+	CHECK(n > 0);
+}
+
+static void test_unpack(void)
+{
+	struct xmmrpc_buf b;
+	const uint8_t *s;
+	uint32_t x, y;
+	size_t len;
+
+	xmmrpc_buf_init(&b);
+	xmmrpc_pack_long(&b, 0xdeadbeef);
+	xmmrpc_pack_string(&b, "hello", 5, 8, 1);
+	xmmrpc_pack_short(&b, 0x1234);
+	CHECK(!xmmrpc_unpack(b.data, b.len, "nsn", &x, &s, &len, &y));
+	CHECK(x == 0xdeadbeef && y == 0x1234);
+	CHECK(len == 5 && !memcmp(s, "hello", 5));
+	CHECK(xmmrpc_unpack(b.data, b.len, "nsnn", &x, &s, &len, &y, &y) < 0);
+	xmmrpc_buf_free(&b);
+}
+
+static void test_frame(void)
+{
+	static const uint8_t zero[] = { 0x02, 0x04, 0, 0, 0, 0 };
+	struct xmmrpc_msg msg;
+	struct xmmrpc_buf b;
+
+	/* As XMMRPC.execute('UtaMsNetOpen') writes it */
+	xmmrpc_buf_init(&b);
+	CHECK(!xmmrpc_frame(&b, XMMRPC_UtaMsNetOpen, zero, sizeof(zero), 0));
+	CHECK(b.len == 26);
+	CHECK(!memcmp(b.data,
+		      "\x16\0\0\0\x02\x04\0\0\0\x16\x02\x04\0\0\0\x53"
+		      "\x11\0\x01\0\x02\x04\0\0\0\0",
+		      26));
+	CHECK(!xmmrpc_parse(b.data, b.len, &msg));
+	CHECK(msg.type == XMMRPC_RESPONSE && msg.code == XMMRPC_UtaMsNetOpen);
+	CHECK(msg.body_len == 6);
+	xmmrpc_buf_free(&b);
+
+	/* An async response repeats the tid, which parse strips */
+	CHECK(!xmmrpc_frame(&b, XMMRPC_UtaMsNetAttachReq, zero, sizeof(zero),
+			    1));
+	CHECK(b.len == 32);
+	CHECK(!xmmrpc_parse(b.data, b.len, &msg));
+	CHECK(msg.type == XMMRPC_RESPONSE && msg.tid == 0x11000101);
+	CHECK(msg.body_len == 6 && !memcmp(msg.body, zero, 6));
+	xmmrpc_buf_free(&b);
+}
+
+static void test_sha256(void)
+{
+	static const uint8_t abc[32] = {
+		0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea,
+		0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+		0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c,
+		0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad,
+	};
+	uint8_t out[32];
+
+	xmmrpc_sha256("abc", 3, out);
+	CHECK(!memcmp(out, abc, sizeof(abc)));
+}
+
+int main(int argc, char **argv)
+{
+	test_vectors(argc > 1 ? argv[1] : "test_vectors.txt");
+	test_unpack();
+	test_frame();
+	test_sha256();
+
+	if (failures) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("xmmrpc tests passed\n");
+	return 0;
+}
@@ -1,3 +1,46 @@
 #include <asm/ioctl.h>
+#include <stdint.h>
 
 #define XMM7360_IOCTL_GET_PAGE_SIZE _IOC(_IOC_READ, 'x', 0xc0, sizeof(uint32_t))
+#define XMM7360_IOCTL_RESET_QP _IO('x', 0xc1)
+
+/* Trace cdev: with XMM7360_TRACE_DEFRAME set, each read returns one
+ * unescaped record whose stream (byte 0) and type (byte 7) pass the masks.
+ */
+struct xmm7360_trace_filter {
+	uint32_t flags;
+	uint32_t streams;
+	uint32_t types[8];
+};
+
+#define XMM7360_TRACE_DEFRAME 1
+
+struct xmm7360_trace_stats {
+	uint64_t records;
+	uint64_t filtered;
+	uint64_t overruns;
+	uint64_t oversize;
+};
+
+#define XMM7360_IOCTL_SET_TRACE_FILTER _IOW('x', 0xc2, struct xmm7360_trace_filter)
+#define XMM7360_IOCTL_GET_TRACE_STATS _IOR('x', 0xc3, struct xmm7360_trace_stats)
+
+/* RPC cdev: any number of processes may hold it open, each seeing the
+ * answers to its own calls. arg 0 stops unsolicited messages to this file.
+ */
+#define XMM7360_IOCTL_RPC_UNSOL _IO('x', 0xc4)
+
+/* Pass only the unsolicited codes whose bits are set; codes of 512 and up
+ * are always passed. Responses are never filtered.
+ */
+struct xmm7360_rpc_unsol_filter {
+	uint32_t codes[16];
+};
+
+struct xmm7360_rpc_stats {
+	uint64_t filtered;
+	uint64_t dropped;
+};
+
+#define XMM7360_IOCTL_RPC_UNSOL_FILTER _IOW('x', 0xc5, struct xmm7360_rpc_unsol_filter)
+#define XMM7360_IOCTL_RPC_GET_STATS _IOR('x', 0xc6, struct xmm7360_rpc_stats)
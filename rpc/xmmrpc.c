@@ -0,0 +1,849 @@
+#include "xmmrpc.h"
+#include "xmm7360.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#define RX_SIZE 131072
+
+#define TID_SYNC 0x11000100
+#define TID_ASYNC 0x11000101
+
+void xmmrpc_buf_init(struct xmmrpc_buf *b)
+{
+	memset(b, 0, sizeof(*b));
+}
+
+void xmmrpc_buf_free(struct xmmrpc_buf *b)
+{
+	free(b->data);
+	xmmrpc_buf_init(b);
+}
+
+static uint8_t *buf_grow(struct xmmrpc_buf *b, size_t len)
+{
+	size_t size;
+	uint8_t *data;
+
+	if (b->error)
+		return NULL;
+
+	if (b->len + len > b->size) {
+		size = b->size ? b->size : 256;
+		while (size < b->len + len)
+			size *= 2;
+		data = realloc(b->data, size);
+		if (!data) {
+			b->error = -ENOMEM;
+			return NULL;
+		}
+		b->data = data;
+		b->size = size;
+	}
+
+	data = b->data + b->len;
+	b->len += len;
+	return data;
+}
+
+void xmmrpc_buf_put(struct xmmrpc_buf *b, const void *data, size_t len)
+{
+	uint8_t *p = buf_grow(b, len);
+
+	if (p)
+		memcpy(p, data, len);
+}
+
+static void buf_zero(struct xmmrpc_buf *b, size_t len)
+{
+	uint8_t *p = buf_grow(b, len);
+
+	if (p)
+		memset(p, 0, len);
+}
+
+static void put_be(uint8_t *p, uint32_t val, int bytes)
+{
+	while (bytes--) {
+		p[bytes] = val & 0xff;
+		val >>= 8;
+	}
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return (uint32_t)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
+}
+
+static void pack_int(struct xmmrpc_buf *b, uint32_t val, int bytes)
+{
+	uint8_t *p = buf_grow(b, 2 + bytes);
+
+	if (!p)
+		return;
+	p[0] = 0x02;
+	p[1] = bytes;
+	put_be(p + 2, val, bytes);
+}
+
+void xmmrpc_pack_byte(struct xmmrpc_buf *b, uint8_t val)
+{
+	pack_int(b, val, 1);
+}
+
+void xmmrpc_pack_short(struct xmmrpc_buf *b, uint16_t val)
+{
+	pack_int(b, val, 2);
+}
+
+void xmmrpc_pack_long(struct xmmrpc_buf *b, uint32_t val)
+{
+	pack_int(b, val, 4);
+}
+
+void xmmrpc_pack_string(struct xmmrpc_buf *b, const void *val, size_t valid,
+			size_t length, size_t elem_size)
+{
+	uint8_t hdr[6];
+	int n = 0, i;
+	size_t remain;
+
+	hdr[n++] = elem_size == 4 ? 0x57 : elem_size == 2 ? 0x56 : 0x55;
+	if (valid < 128) {
+		hdr[n++] = valid;
+	} else {
+		/* rpc.py writes long counts big endian but reads them back
+		 * little endian; match what it writes.
+		 */
+		for (remain = valid, i = 0; remain; remain >>= 8)
+			i++;
+		hdr[n++] = 0x80 + i;
+		put_be(hdr + n, valid, i);
+		n += i;
+	}
+	xmmrpc_buf_put(b, hdr, n);
+	xmmrpc_pack_long(b, length * elem_size);
+	xmmrpc_pack_long(b, (length - valid) * elem_size);
+	xmmrpc_buf_put(b, val, valid * elem_size);
+	buf_zero(b, (length - valid) * elem_size);
+}
+
+int xmmrpc_take_int(struct xmmrpc_reader *rd, uint32_t *val)
+{
+	size_t len, i;
+
+	if (rd->len < 2 || rd->data[0] != 0x02)
+		return -EPROTO;
+	len = rd->data[1];
+	if (len > 4 || rd->len < 2 + len)
+		return -EPROTO;
+
+	*val = 0;
+	for (i = 0; i < len; i++)
+		*val = *val << 8 | rd->data[2 + i];
+
+	rd->data += 2 + len;
+	rd->len -= 2 + len;
+	return 0;
+}
+
+int xmmrpc_take_string(struct xmmrpc_reader *rd, const uint8_t **val,
+		       size_t *len)
+{
+	uint32_t count, padding;
+	size_t valid;
+	int type, i, n, ret;
+
+	if (rd->len < 2)
+		return -EPROTO;
+	type = rd->data[0];
+	if (type < 0x55 || type > 0x57)
+		return -EPROTO;
+	valid = rd->data[1];
+	rd->data += 2;
+	rd->len -= 2;
+
+	if (valid & 0x80) {
+		n = valid & 0xf;
+		if (rd->len < (size_t)n)
+			return -EPROTO;
+		valid = 0;
+		for (i = 0; i < n; i++)
+			valid |= (size_t)rd->data[i] << (i * 8);
+		rd->data += n;
+		rd->len -= n;
+	}
+	if (type == 0x56)
+		valid <<= 1;
+	else if (type == 0x57)
+		valid <<= 2;
+
+	ret = xmmrpc_take_int(rd, &count);
+	if (!ret)
+		ret = xmmrpc_take_int(rd, &padding);
+	if (ret)
+		return ret;
+	if (count && count != valid + padding)
+		return -EPROTO;
+	if (rd->len < valid + padding)
+		return -EPROTO;
+
+	*val = rd->data;
+	*len = valid;
+	rd->data += valid + padding;
+	rd->len -= valid + padding;
+	return 0;
+}
+
+int xmmrpc_unpack(const uint8_t *data, size_t len, const char *fmt, ...)
+{
+	struct xmmrpc_reader rd = { data, len };
+	const uint8_t **sval;
+	size_t *slen;
+	va_list ap;
+	int ret = 0;
+
+	va_start(ap, fmt);
+	for (; *fmt && !ret; fmt++) {
+		switch (*fmt) {
+		case 'n':
+			ret = xmmrpc_take_int(&rd, va_arg(ap, uint32_t *));
+			break;
+		case 's':
+			sval = va_arg(ap, const uint8_t **);
+			slen = va_arg(ap, size_t *);
+			ret = xmmrpc_take_string(&rd, sval, slen);
+			break;
+		default:
+			ret = -EINVAL;
+		}
+	}
+	va_end(ap);
+	return ret;
+}
+
+/* Integer field n of a body of unknown layout, as unpack_unknown() */
+static int nth_int(const uint8_t *data, size_t len, int n, uint32_t *val)
+{
+	struct xmmrpc_reader rd = { data, len };
+	const uint8_t *sval;
+	size_t slen;
+	int i, ret;
+
+	for (i = 0;; i++) {
+		if (!rd.len)
+			return -EPROTO;
+		if (rd.data[0] == 0x02) {
+			ret = xmmrpc_take_int(&rd, val);
+			if (ret || i == n)
+				return ret;
+		} else {
+			ret = xmmrpc_take_string(&rd, &sval, &slen);
+			if (ret)
+				return ret;
+			if (i == n)
+				return -EPROTO;
+		}
+	}
+}
+
+int xmmrpc_frame(struct xmmrpc_buf *out, uint32_t cmd, const uint8_t *body,
+		 size_t len, int is_async)
+{
+	uint32_t tid_word = is_async ? TID_ASYNC : TID_SYNC;
+	uint32_t total = len + 16 + (is_async ? 6 : 0);
+	uint8_t *p = buf_grow(out, 4);
+
+	if (p) {
+		p[0] = total & 0xff;
+		p[1] = total >> 8 & 0xff;
+		p[2] = total >> 16 & 0xff;
+		p[3] = total >> 24;
+	}
+	xmmrpc_pack_long(out, total);
+	xmmrpc_pack_long(out, cmd);
+	p = buf_grow(out, 4);
+	if (p)
+		put_be(p, tid_word, 4);
+	if (is_async)
+		xmmrpc_pack_long(out, tid_word);
+	xmmrpc_buf_put(out, body, len);
+	return out->error;
+}
+
+int xmmrpc_parse(const uint8_t *data, size_t len, struct xmmrpc_msg *msg)
+{
+	uint32_t first;
+
+	if (len < 20 || data[4] != 0x02 || data[5] != 0x04 ||
+	    data[10] != 0x02 || data[11] != 0x04)
+		return -EPROTO;
+
+	msg->code = get_be32(data + 12);
+	msg->tid = get_be32(data + 16);
+	msg->body = data + 20;
+	msg->body_len = len - 20;
+
+	if (msg->tid == TID_SYNC) {
+		msg->type = XMMRPC_RESPONSE;
+	} else if ((msg->tid & 0xffffff00) == TID_SYNC) {
+		if (msg->code >= 2000) {
+			msg->type = XMMRPC_ASYNC_ACK;
+		} else {
+			/* The response repeats the tid; strip it */
+			msg->type = XMMRPC_RESPONSE;
+			if (nth_int(msg->body, msg->body_len, 0, &first) ||
+			    first != msg->tid || msg->body_len < 6)
+				return -EPROTO;
+			msg->body += 6;
+			msg->body_len -= 6;
+		}
+	} else {
+		msg->type = XMMRPC_UNSOLICITED;
+	}
+	return 0;
+}
+
+int xmmrpc_open(struct xmmrpc *r, const char *path)
+{
+	int ret;
+
+	memset(r, 0, sizeof(*r));
+	r->rx = malloc(RX_SIZE);
+	if (!r->rx)
+		return -ENOMEM;
+	r->fd = open(path, O_RDWR | O_SYNC);
+	if (r->fd < 0) {
+		ret = -errno;
+		free(r->rx);
+		r->rx = NULL;
+		return ret;
+	}
+	return 0;
+}
+
+void xmmrpc_close(struct xmmrpc *r)
+{
+	if (r->fd >= 0)
+		close(r->fd);
+	free(r->rx);
+	r->fd = -1;
+	r->rx = NULL;
+}
+
+int xmmrpc_pump(struct xmmrpc *r, struct xmmrpc_msg *msg)
+{
+	uint32_t allowed;
+	ssize_t len;
+	int ret;
+
+	len = read(r->fd, r->rx, RX_SIZE);
+	if (len < 0)
+		return -errno;
+	ret = xmmrpc_parse(r->rx, len, msg);
+	if (ret)
+		return ret;
+
+	if (msg->type == XMMRPC_UNSOLICITED) {
+		if (msg->code == XMMRPC_UNSOL_UtaMsNetIsAttachAllowedIndCb &&
+		    !nth_int(msg->body, msg->body_len, 2, &allowed))
+			r->attach_allowed = allowed;
+		if (r->unsolicited)
+			r->unsolicited(r, msg);
+	}
+	return 0;
+}
+
+int xmmrpc_execute(struct xmmrpc *r, uint32_t cmd,
+		   const struct xmmrpc_buf *body, int is_async,
+		   struct xmmrpc_msg *resp)
+{
+	static const uint8_t zero[] = { 0x02, 0x04, 0, 0, 0, 0 };
+	struct xmmrpc_buf out;
+	ssize_t written;
+	int ret;
+
+	if (body && body->error)
+		return body->error;
+
+	xmmrpc_buf_init(&out);
+	if (body)
+		ret = xmmrpc_frame(&out, cmd, body->data, body->len, is_async);
+	else
+		ret = xmmrpc_frame(&out, cmd, zero, sizeof(zero), is_async);
+	if (ret)
+		goto out;
+
+	written = write(r->fd, out.data, out.len);
+	if (written < 0) {
+		ret = -errno;
+		goto out;
+	}
+	if ((size_t)written < out.len) {
+		ret = -EIO;
+		goto out;
+	}
+
+	do {
+		ret = xmmrpc_pump(r, resp);
+	} while (!ret && resp->type != XMMRPC_RESPONSE);
+out:
+	xmmrpc_buf_free(&out);
+	return ret;
+}
+
+int xmmrpc_set_unsol_filter(struct xmmrpc *r, const uint16_t *codes,
+			    size_t n)
+{
+	struct xmm7360_rpc_unsol_filter filter;
+	size_t i;
+
+	memset(&filter, 0, sizeof(filter));
+	for (i = 0; i < n; i++) {
+		if (codes[i] >= sizeof(filter.codes) * 8)
+			return -EINVAL;
+		filter.codes[codes[i] / 32] |= 1u << (codes[i] % 32);
+	}
+	if (ioctl(r->fd, XMM7360_IOCTL_RPC_UNSOL_FILTER, &filter) < 0)
+		return -errno;
+	return 0;
+}
+
+/* One of the four PDP context blocks in an APN config request */
+static void pack_apn_block(struct xmmrpc_buf *b, const uint8_t *apn,
+			   int configured, int last)
+{
+	static const uint32_t longs[21] = { 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0,
+					    0, 1, 0, 0, 0x404, 1, 0, 1, 0, 0 };
+	static const uint8_t zeros[257];
+	int i;
+
+	xmmrpc_pack_string(b, zeros, 257, 260, 1);
+	xmmrpc_pack_long(b, 0);
+	xmmrpc_pack_string(b, zeros, 65, 66, 1);
+	xmmrpc_pack_string(b, zeros, 65, 65, 1);
+	xmmrpc_pack_string(b, zeros, 250, 250, 1);
+	xmmrpc_pack_byte(b, 0);
+	xmmrpc_pack_string(b, zeros, 250, 252, 1);
+	xmmrpc_pack_short(b, 0);
+	for (i = 0; i < 21; i++)
+		xmmrpc_pack_long(b, configured ? longs[i] : 0);
+	xmmrpc_pack_string(b, zeros, 20, 20, 1);
+	xmmrpc_pack_long(b, configured ? 3 : 0);
+	xmmrpc_pack_string(b, configured ? apn : zeros, 101, last ? 103 : 104,
+			   1);
+}
+
+void xmmrpc_pack_UtaMsCallPsAttachApnConfigReq(struct xmmrpc_buf *b,
+					       const char *apn)
+{
+	uint8_t apn_string[101];
+	size_t len = strlen(apn);
+
+	memset(apn_string, 0, sizeof(apn_string));
+	memcpy(apn_string, apn, len < 101 ? len : 101);
+
+	xmmrpc_pack_byte(b, 0);
+	pack_apn_block(b, apn_string, 0, 0);
+	pack_apn_block(b, apn_string, 0, 0);
+	pack_apn_block(b, apn_string, 1, 0);
+	pack_apn_block(b, apn_string, 1, 1);
+	xmmrpc_pack_byte(b, 3);
+	xmmrpc_pack_long(b, 0);
+}
+
+void xmmrpc_pack_UtaMsNetAttachReq(struct xmmrpc_buf *b)
+{
+	xmmrpc_pack_byte(b, 0);
+	xmmrpc_pack_long(b, 0);
+	xmmrpc_pack_long(b, 0);
+	xmmrpc_pack_long(b, 0);
+	xmmrpc_pack_long(b, 0);
+	xmmrpc_pack_short(b, 0xffff);
+	xmmrpc_pack_short(b, 0xffff);
+	xmmrpc_pack_long(b, 0);
+	xmmrpc_pack_long(b, 0);
+}
+
+void xmmrpc_pack_UtaMsCallPsGetNegIpAddrReq(struct xmmrpc_buf *b)
+{
+	xmmrpc_pack_byte(b, 0);
+	xmmrpc_pack_long(b, 0);
+	xmmrpc_pack_long(b, 0);
+}
+
+void xmmrpc_pack_UtaMsCallPsGetNegotiatedDnsReq(struct xmmrpc_buf *b)
+{
+	xmmrpc_pack_byte(b, 0);
+	xmmrpc_pack_long(b, 0);
+	xmmrpc_pack_long(b, 0);
+}
+
+void xmmrpc_pack_UtaMsCallPsConnectReq(struct xmmrpc_buf *b)
+{
+	xmmrpc_pack_byte(b, 0);
+	xmmrpc_pack_long(b, 6);
+	xmmrpc_pack_long(b, 0);
+	xmmrpc_pack_long(b, 0);
+}
+
+void xmmrpc_pack_UtaRPCPsConnectToDatachannelReq(struct xmmrpc_buf *b,
+						 const char *path)
+{
+	size_t len = strlen(path) + 1;
+
+	xmmrpc_pack_string(b, path, len, 24 > len ? 24 : len, 1);
+}
+
+int xmmrpc_unpack_UtaMsCallPsGetNegIpAddrReq(const uint8_t *body, size_t len,
+					     struct xmmrpc_ip *ip)
+{
+	const uint8_t *addrs;
+	size_t addrs_len;
+	uint32_t n[5];
+	int ret, i;
+
+	ret = xmmrpc_unpack(body, len, "nsnnnn", &n[0], &addrs, &addrs_len,
+			    &n[1], &n[2], &n[3], &n[4]);
+	if (ret)
+		return ret;
+	if (addrs_len < 12)
+		return -EPROTO;
+
+	/* On IPv6 networks the first 8 bytes are half an IPv6 address;
+	 * use the last nonzero IPv4 address.
+	 */
+	memset(ip->addr, 0, sizeof(ip->addr));
+	for (i = 2; i >= 0; i--) {
+		if (get_be32(addrs + i * 4)) {
+			memcpy(ip->addr, addrs + i * 4, 4);
+			break;
+		}
+	}
+	return 0;
+}
+
+int xmmrpc_unpack_UtaMsCallPsGetNegotiatedDnsReq(const uint8_t *body,
+						 size_t len,
+						 struct xmmrpc_ip *ip)
+{
+	struct xmmrpc_reader rd = { body, len };
+	const uint8_t *addr;
+	size_t addr_len;
+	uint32_t val, type;
+	int ret, i;
+
+	ip->n_dns4 = ip->n_dns6 = 0;
+
+	ret = xmmrpc_take_int(&rd, &val);
+	for (i = 0; i < 16 && !ret; i++) {
+		ret = xmmrpc_take_string(&rd, &addr, &addr_len);
+		if (!ret)
+			ret = xmmrpc_take_int(&rd, &type);
+		if (ret)
+			break;
+		if (type == 1 && addr_len >= 4)
+			memcpy(ip->dns4[ip->n_dns4++], addr, 4);
+		else if (type == 2 && addr_len >= 16)
+			memcpy(ip->dns6[ip->n_dns6++], addr, 16);
+	}
+	return ret;
+}
+
+int xmmrpc_init_services(struct xmmrpc *r)
+{
+	static const uint32_t calls[] = {
+		XMMRPC_UtaMsSmsInit,	      XMMRPC_UtaMsCbsInit,
+		XMMRPC_UtaMsNetOpen,	      XMMRPC_UtaMsCallCsInit,
+		XMMRPC_UtaMsCallPsInitialize, XMMRPC_UtaMsSsInit,
+		XMMRPC_UtaMsSimOpenReq,
+	};
+	struct xmmrpc_msg resp;
+	size_t i;
+	int ret;
+
+	for (i = 0; i < sizeof(calls) / sizeof(calls[0]); i++) {
+		ret = xmmrpc_execute(r, calls[i], NULL, 0, &resp);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+int xmmrpc_fcc_unlock(struct xmmrpc *r)
+{
+	/* nvm:fix_cat_fcclock.fcclock_hash[0] */
+	static const uint8_t key[4] = { 0x3d, 0xf8, 0xc7, 0x19 };
+	uint32_t dummy, state, mode, challenge, result;
+	struct xmmrpc_msg resp;
+	struct xmmrpc_buf body;
+	uint8_t hash_in[8], hash[32];
+	int ret;
+
+	ret = xmmrpc_execute(r, XMMRPC_CsiFccLockQueryReq, NULL, 1, &resp);
+	if (!ret)
+		ret = xmmrpc_unpack(resp.body, resp.body_len, "nnn", &dummy,
+				    &state, &mode);
+	if (ret)
+		return ret;
+	if (!mode || state)
+		return 0;
+
+	ret = xmmrpc_execute(r, XMMRPC_CsiFccLockGenChallengeReq, NULL, 1,
+			     &resp);
+	if (!ret)
+		ret = xmmrpc_unpack(resp.body, resp.body_len, "nn", &dummy,
+				    &challenge);
+	if (ret)
+		return ret;
+
+	hash_in[0] = challenge & 0xff;
+	hash_in[1] = challenge >> 8 & 0xff;
+	hash_in[2] = challenge >> 16 & 0xff;
+	hash_in[3] = challenge >> 24;
+	memcpy(hash_in + 4, key, sizeof(key));
+	xmmrpc_sha256(hash_in, sizeof(hash_in), hash);
+
+	xmmrpc_buf_init(&body);
+	xmmrpc_pack_long(&body, get_le32(hash));
+	ret = xmmrpc_execute(r, XMMRPC_CsiFccLockVerChallengeReq, &body, 1,
+			     &resp);
+	xmmrpc_buf_free(&body);
+	if (!ret)
+		ret = xmmrpc_unpack(resp.body, resp.body_len, "n", &result);
+	if (ret)
+		return ret;
+	return result == 1 ? 0 : -EACCES;
+}
+
+int xmmrpc_mode_set(struct xmmrpc *r, uint32_t mode)
+{
+	struct xmmrpc_msg msg;
+	struct xmmrpc_buf body;
+	uint32_t val;
+	int ret;
+
+	xmmrpc_buf_init(&body);
+	xmmrpc_pack_long(&body, 0);
+	xmmrpc_pack_long(&body, 15);
+	xmmrpc_pack_long(&body, mode);
+	ret = xmmrpc_execute(r, XMMRPC_UtaModeSetReq, &body, 0, &msg);
+	xmmrpc_buf_free(&body);
+	if (ret)
+		return ret;
+	if (nth_int(msg.body, msg.body_len, 0, &val) || val)
+		return -EINVAL;
+
+	for (;;) {
+		ret = xmmrpc_pump(r, &msg);
+		if (ret)
+			return ret;
+		if (msg.type != XMMRPC_UNSOLICITED ||
+		    msg.code != XMMRPC_UNSOL_UtaModeSetRspCb)
+			continue;
+		/* A refused mode usually means the FCC lock is still on */
+		if (nth_int(msg.body, msg.body_len, 0, &val) || val != mode)
+			return -EPERM;
+		return 0;
+	}
+}
+
+static int net_attach(struct xmmrpc *r, uint32_t *status)
+{
+	struct xmmrpc_msg resp;
+	struct xmmrpc_buf body;
+	uint32_t dummy;
+	int ret;
+
+	xmmrpc_buf_init(&body);
+	xmmrpc_pack_UtaMsNetAttachReq(&body);
+	ret = xmmrpc_execute(r, XMMRPC_UtaMsNetAttachReq, &body, 1, &resp);
+	xmmrpc_buf_free(&body);
+	if (ret)
+		return ret;
+	return xmmrpc_unpack(resp.body, resp.body_len, "nn", &dummy, status);
+}
+
+int xmmrpc_attach(struct xmmrpc *r, const char *apn)
+{
+	struct xmmrpc_msg msg;
+	struct xmmrpc_buf body;
+	uint32_t status;
+	int ret;
+
+	xmmrpc_buf_init(&body);
+	xmmrpc_pack_UtaMsCallPsAttachApnConfigReq(&body, apn);
+	ret = xmmrpc_execute(r, XMMRPC_UtaMsCallPsAttachApnConfigReq, &body,
+			     1, &msg);
+	xmmrpc_buf_free(&body);
+	if (ret)
+		return ret;
+
+	ret = net_attach(r, &status);
+	if (ret || status != 0xffffffff)
+		return ret;
+
+	/* Probably just not ready yet; wait until the modem says so */
+	while (!r->attach_allowed) {
+		ret = xmmrpc_pump(r, &msg);
+		if (ret)
+			return ret;
+	}
+
+	ret = net_attach(r, &status);
+	if (ret)
+		return ret;
+	return status == 0xffffffff ? -ENETUNREACH : 0;
+}
+
+int xmmrpc_get_ip(struct xmmrpc *r, struct xmmrpc_ip *ip)
+{
+	struct xmmrpc_msg resp;
+	struct xmmrpc_buf body;
+	int ret;
+
+	xmmrpc_buf_init(&body);
+	xmmrpc_pack_UtaMsCallPsGetNegIpAddrReq(&body);
+	ret = xmmrpc_execute(r, XMMRPC_UtaMsCallPsGetNegIpAddrReq, &body, 1,
+			     &resp);
+	if (!ret)
+		ret = xmmrpc_unpack_UtaMsCallPsGetNegIpAddrReq(
+			resp.body, resp.body_len, ip);
+	xmmrpc_buf_free(&body);
+	if (ret)
+		return ret;
+
+	xmmrpc_pack_UtaMsCallPsGetNegotiatedDnsReq(&body);
+	ret = xmmrpc_execute(r, XMMRPC_UtaMsCallPsGetNegotiatedDnsReq, &body,
+			     1, &resp);
+	if (!ret)
+		ret = xmmrpc_unpack_UtaMsCallPsGetNegotiatedDnsReq(
+			resp.body, resp.body_len, ip);
+	xmmrpc_buf_free(&body);
+	if (ret)
+		return ret;
+
+	return get_be32(ip->addr) != 0;
+}
+
+int xmmrpc_connect_datachannel(struct xmmrpc *r)
+{
+	static const uint8_t trailer[] = { 0x02, 0x04, 0, 0, 0, 0 };
+	struct xmmrpc_buf body, setup;
+	struct xmmrpc_msg resp;
+	int ret;
+
+	xmmrpc_buf_init(&body);
+	xmmrpc_buf_init(&setup);
+
+	/* The connect response carries most of the setup request */
+	xmmrpc_pack_UtaMsCallPsConnectReq(&body);
+	ret = xmmrpc_execute(r, XMMRPC_UtaMsCallPsConnectReq, &body, 1, &resp);
+	if (ret)
+		goto out;
+	if (resp.body_len < 6) {
+		ret = -EPROTO;
+		goto out;
+	}
+	xmmrpc_buf_put(&setup, resp.body, resp.body_len - 6);
+
+	/* and the datachannel handle the rest */
+	xmmrpc_buf_free(&body);
+	xmmrpc_pack_UtaRPCPsConnectToDatachannelReq(&body,
+						    "/sioscc/PCIE/IOSM/IPS/0");
+	ret = xmmrpc_execute(r, XMMRPC_UtaRPCPsConnectToDatachannelReq, &body,
+			     0, &resp);
+	if (ret)
+		goto out;
+	xmmrpc_buf_put(&setup, resp.body, resp.body_len);
+	xmmrpc_buf_put(&setup, trailer, sizeof(trailer));
+
+	ret = xmmrpc_execute(r, XMMRPC_UtaRPCPSConnectSetupReq, &setup, 0,
+			     &resp);
+out:
+	xmmrpc_buf_free(&body);
+	xmmrpc_buf_free(&setup);
+	return ret;
+}
+
+/* SHA-256 (FIPS 180-4), only needed for the FCC unlock response */
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+static void sha256_block(uint32_t h[8], const uint8_t *p)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, k, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = get_be32(p + i * 4);
+	for (; i < 64; i++)
+		w[i] = w[i - 16] + w[i - 7] +
+		       (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^
+			w[i - 15] >> 3) +
+		       (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ w[i - 2] >> 10);
+
+	a = h[0], b = h[1], c = h[2], d = h[3];
+	e = h[4], f = h[5], g = h[6], k = h[7];
+	for (i = 0; i < 64; i++) {
+		t1 = k + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) +
+		     ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) +
+		     ((a & b) ^ (a & c) ^ (b & c));
+		k = g, g = f, f = e, e = d + t1;
+		d = c, c = b, b = a, a = t1 + t2;
+	}
+	h[0] += a, h[1] += b, h[2] += c, h[3] += d;
+	h[4] += e, h[5] += f, h[6] += g, h[7] += k;
+}
+
+void xmmrpc_sha256(const void *data, size_t len, uint8_t out[32])
+{
+	uint32_t h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+			  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+	const uint8_t *p = data;
+	uint8_t tail[128];
+	size_t rest, tail_len;
+	uint64_t bits = (uint64_t)len * 8;
+	int i;
+
+	for (; len >= 64; len -= 64, p += 64)
+		sha256_block(h, p);
+
+	rest = len;
+	tail_len = rest < 56 ? 64 : 128;
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, p, rest);
+	tail[rest] = 0x80;
+	for (i = 0; i < 8; i++)
+		tail[tail_len - 1 - i] = bits >> (i * 8);
+
+	sha256_block(h, tail);
+	if (tail_len == 128)
+		sha256_block(h, tail + 64);
+
+	for (i = 0; i < 8; i++)
+		put_be(out + i * 4, h[i], 4);
+}
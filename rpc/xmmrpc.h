@@ -0,0 +1,150 @@
+/*
+ * C client for the XMM7360 RPC protocol spoken over /dev/xmmN/rpc.
+ *
+ * This follows rpc.py: the same message framing, the same pack()/unpack()
+ * encoding and the bring-up sequence of open_xdatachannel.py.
+ *
+ * Functions return 0 or a positive count on success and a negative errno
+ * on failure.
+ */
+#ifndef XMMRPC_H
+#define XMMRPC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Call IDs used here, from rpc_call_ids.py */
+#define XMMRPC_UtaMsSimOpenReq 0x001
+#define XMMRPC_UtaMsCallCsInit 0x024
+#define XMMRPC_UtaMsCbsInit 0x025
+#define XMMRPC_UtaMsSsInit 0x026
+#define XMMRPC_UtaMsSmsInit 0x030
+#define XMMRPC_UtaMsCallPsInitialize 0x03a
+#define XMMRPC_UtaMsCallPsGetNegotiatedDnsReq 0x047
+#define XMMRPC_UtaMsCallPsGetNegIpAddrReq 0x049
+#define XMMRPC_UtaMsCallPsConnectReq 0x051
+#define XMMRPC_UtaMsNetOpen 0x053
+#define XMMRPC_UtaMsNetAttachReq 0x05c
+#define XMMRPC_UtaSysGetInfo 0x07c
+#define XMMRPC_UtaRPCPSConnectSetupReq 0x07d
+#define XMMRPC_UtaRPCPsConnectToDatachannelReq 0x07e
+#define XMMRPC_UtaModeSetReq 0x12f
+#define XMMRPC_CsiFccLockQueryReq 0x18e
+#define XMMRPC_CsiFccLockGenChallengeReq 0x190
+#define XMMRPC_CsiFccLockVerChallengeReq 0x192
+#define XMMRPC_UtaMsCallPsAttachApnConfigReq 0x1af
+
+/* Unsolicited codes, from rpc_unsol_table.py */
+#define XMMRPC_UNSOL_UtaMsNetIsAttachAllowedIndCb 0x06c
+#define XMMRPC_UNSOL_UtaModeSetRspCb 0x12d
+
+/* Growable output buffer; allocation failure sticks in error */
+struct xmmrpc_buf {
+	uint8_t *data;
+	size_t len, size;
+	int error;
+};
+
+void xmmrpc_buf_init(struct xmmrpc_buf *b);
+void xmmrpc_buf_free(struct xmmrpc_buf *b);
+void xmmrpc_buf_put(struct xmmrpc_buf *b, const void *data, size_t len);
+
+/* pack() in rpc.py: 'B', 'H' and 'L' integers and 's'/'S' strings. valid
+ * and length count elements of elem_size (1, 2 or 4) bytes.
+ */
+void xmmrpc_pack_byte(struct xmmrpc_buf *b, uint8_t val);
+void xmmrpc_pack_short(struct xmmrpc_buf *b, uint16_t val);
+void xmmrpc_pack_long(struct xmmrpc_buf *b, uint32_t val);
+void xmmrpc_pack_string(struct xmmrpc_buf *b, const void *val, size_t valid,
+			size_t length, size_t elem_size);
+
+struct xmmrpc_reader {
+	const uint8_t *data;
+	size_t len;
+};
+
+/* unpack() in rpc.py. fmt is a string of 'n' (takes a uint32_t *) and
+ * 's' (takes a const uint8_t ** and a size_t *); strings point into the
+ * reader's data.
+ */
+int xmmrpc_take_int(struct xmmrpc_reader *rd, uint32_t *val);
+int xmmrpc_take_string(struct xmmrpc_reader *rd, const uint8_t **val,
+		       size_t *len);
+int xmmrpc_unpack(const uint8_t *data, size_t len, const char *fmt, ...);
+
+enum xmmrpc_msg_type {
+	XMMRPC_RESPONSE,
+	XMMRPC_ASYNC_ACK,
+	XMMRPC_UNSOLICITED,
+};
+
+struct xmmrpc_msg {
+	enum xmmrpc_msg_type type;
+	uint32_t code;
+	uint32_t tid;
+	// points into the receive buffer, valid until the next read
+	const uint8_t *body;
+	size_t body_len;
+};
+
+int xmmrpc_frame(struct xmmrpc_buf *out, uint32_t cmd, const uint8_t *body,
+		 size_t len, int is_async);
+int xmmrpc_parse(const uint8_t *data, size_t len, struct xmmrpc_msg *msg);
+
+struct xmmrpc {
+	int fd;
+	uint8_t *rx;
+	int attach_allowed;
+	// optional, called for every unsolicited message
+	void (*unsolicited)(struct xmmrpc *r, const struct xmmrpc_msg *msg);
+	void *priv;
+};
+
+int xmmrpc_open(struct xmmrpc *r, const char *path);
+void xmmrpc_close(struct xmmrpc *r);
+int xmmrpc_pump(struct xmmrpc *r, struct xmmrpc_msg *msg);
+/* body may be NULL for the default single zero integer */
+int xmmrpc_execute(struct xmmrpc *r, uint32_t cmd,
+		   const struct xmmrpc_buf *body, int is_async,
+		   struct xmmrpc_msg *resp);
+/* Have the driver drop all unsolicited messages but these */
+int xmmrpc_set_unsol_filter(struct xmmrpc *r, const uint16_t *codes,
+			    size_t n);
+
+/* Request bodies, as the pack_* functions in rpc.py */
+void xmmrpc_pack_UtaMsCallPsAttachApnConfigReq(struct xmmrpc_buf *b,
+					       const char *apn);
+void xmmrpc_pack_UtaMsNetAttachReq(struct xmmrpc_buf *b);
+void xmmrpc_pack_UtaMsCallPsGetNegIpAddrReq(struct xmmrpc_buf *b);
+void xmmrpc_pack_UtaMsCallPsGetNegotiatedDnsReq(struct xmmrpc_buf *b);
+void xmmrpc_pack_UtaMsCallPsConnectReq(struct xmmrpc_buf *b);
+void xmmrpc_pack_UtaRPCPsConnectToDatachannelReq(struct xmmrpc_buf *b,
+						 const char *path);
+
+#define XMMRPC_MAX_DNS 16
+
+struct xmmrpc_ip {
+	uint8_t addr[4]; // last nonzero IPv4 address, or zero
+	int n_dns4, n_dns6;
+	uint8_t dns4[XMMRPC_MAX_DNS][4];
+	uint8_t dns6[XMMRPC_MAX_DNS][16];
+};
+
+int xmmrpc_unpack_UtaMsCallPsGetNegIpAddrReq(const uint8_t *body, size_t len,
+					     struct xmmrpc_ip *ip);
+int xmmrpc_unpack_UtaMsCallPsGetNegotiatedDnsReq(const uint8_t *body,
+						 size_t len,
+						 struct xmmrpc_ip *ip);
+
+/* Bring-up steps of open_xdatachannel.py, in order */
+int xmmrpc_init_services(struct xmmrpc *r);
+int xmmrpc_fcc_unlock(struct xmmrpc *r);
+int xmmrpc_mode_set(struct xmmrpc *r, uint32_t mode);
+int xmmrpc_attach(struct xmmrpc *r, const char *apn);
+/* Returns 1 with ip filled in, 0 if no address has been assigned yet */
+int xmmrpc_get_ip(struct xmmrpc *r, struct xmmrpc_ip *ip);
+int xmmrpc_connect_datachannel(struct xmmrpc *r);
+
+void xmmrpc_sha256(const void *data, size_t len, uint8_t out[32]);
+
+#endif
@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+'''Live view of XMM7360 traffic per queue pair.
+
+Every interval the driver's sysfs attributes and ethtool statistics are
+sampled, which costs a handful of small reads, and the differences are
+shown as rates. Rings that are holding up traffic are highlighted:
+
+  TX FULL   the modem is not taking uplink TDs as fast as they are written
+  RX EMPTY  no buffers are posted for the modem to receive into, so the
+            host is not keeping up with downlink
+'''
+
+import argparse
+import sys
+import time
+from os.path import join
+
+from exporter import DriverStats, read_sysfs, ring_fill
+
+QP_NAMES = {0: 'mux', 1: 'rpc', 3: 'trace'}
+
+RED = '\033[1;31m'
+BOLD = '\033[1m'
+RESET = '\033[0m'
+CLEAR = '\033[H\033[2J'
+
+
+class Sample(object):
+    def __init__(self, driver):
+        self.time = time.monotonic()
+        self.rings = driver.rings()
+        self.irqs = driver.device_counter('irqs') or 0
+        self.doorbells = driver.device_counter('doorbells') or 0
+        self.state = read_sysfs(join(driver.devdir, 'state'))
+        try:
+            self.ethtool = driver.ethtool_stats()
+        except OSError:
+            self.ethtool = {}
+        try:
+            self.netdev = driver.netdev_stats()
+        except OSError:
+            self.netdev = {}
+
+
+def human(value):
+    for unit in ('', 'K', 'M', 'G'):
+        if abs(value) < 1000:
+            break
+        value /= 1000.
+    return ('%.0f%s' if unit == '' else '%.1f%s') % (value, unit)
+
+
+def rate(new, old, seconds):
+    # counters go backwards when the device is reset
+    return max(new - old, 0) / seconds
+
+
+def ring_stalls(num, ring):
+    '''Why this ring is holding traffic up, if it is'''
+    if num & 1:
+        return 'RX EMPTY' if ring_fill(ring) == 0 else None
+    return 'TX FULL' if ring_fill(ring) == ring.depth - 1 else None
+
+
+def render(prev, cur, color=True):
+    def hl(text, code):
+        return code + text + RESET if color else text
+
+    secs = cur.time - prev.time
+    irqs = rate(cur.irqs, prev.irqs, secs)
+    dbs = rate(cur.doorbells, prev.doorbells, secs)
+    lines = [
+        '%s  state %s  irqs/s %s  doorbells/s %s  doorbells/irq %s' %
+        (hl('xmm7360', BOLD), cur.state or '?', human(irqs), human(dbs),
+         '%.2f' % (dbs / irqs) if irqs else '-'),
+        '',
+        hl('%-9s %9s %8s %8s %9s %8s %8s  %s' %
+           ('QP', 'TX B/s', 'TX TD/s', 'TX fill', 'RX B/s', 'RX TD/s',
+            'RX fill', 'stalls'), BOLD),
+    ]
+
+    for qp in sorted(set(num // 2 for num in cur.rings)):
+        cols = []
+        stalls = []
+        for num in (qp * 2, qp * 2 + 1):
+            ring = cur.rings.get(num)
+            old = prev.rings.get(num, ring)
+            if ring is None:
+                cols += ['-', '-', '-']
+                continue
+            cols += [human(rate(ring.bytes, old.bytes, secs)),
+                     human(rate(ring.tds, old.tds, secs)),
+                     '%d/%d' % (ring_fill(ring), ring.depth)]
+            stall = ring_stalls(num, ring)
+            if stall:
+                stalls.append(stall)
+        name = '%d %s' % (qp, QP_NAMES.get(qp, 'tty'))
+        lines.append('%-9s %9s %8s %8s %9s %8s %8s  %s' %
+                     tuple([name] + cols + [hl(' '.join(stalls), RED)
+                                            if stalls else '']))
+
+    mux_rx = cur.rings.get(1)
+    if cur.ethtool and mux_rx is not None:
+        old_rx = prev.rings.get(1, mux_rx)
+        tx_frames = rate(cur.ethtool.get('tx_frames', 0),
+                         prev.ethtool.get('tx_frames', 0), secs)
+        tx_pkts = rate(cur.ethtool.get('tx_frame_packets', 0),
+                       prev.ethtool.get('tx_frame_packets', 0), secs)
+        # every TD on the mux Rx ring carries one frame
+        rx_frames = rate(mux_rx.tds, old_rx.tds, secs)
+        rx_pkts = rate(cur.netdev.get('rx_packets', 0),
+                       prev.netdev.get('rx_packets', 0), secs)
+        lines += [
+            '',
+            'mux frames/s  tx %s (%s pkts/frame)  rx %s (%s pkts/frame)' %
+            (human(tx_frames),
+             '%.1f' % (tx_pkts / tx_frames) if tx_frames else '-',
+             human(rx_frames),
+             '%.1f' % (rx_pkts / rx_frames) if rx_frames else '-'),
+        ]
+    return lines
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('-i', '--interface', default='wwan0')
+    parser.add_argument('-d', '--interval', type=float, default=1.0,
+                        help="Seconds between samples")
+    parser.add_argument('-n', '--count', type=int, default=0,
+                        help="Stop after this many updates")
+    parser.add_argument('--no-color', action='store_true')
+    args = parser.parse_args()
+
+    color = sys.stdout.isatty() and not args.no_color
+    driver = DriverStats(args.interface)
+    prev = Sample(driver)
+    updates = 0
+    try:
+        while not args.count or updates < args.count:
+            time.sleep(args.interval)
+            cur = Sample(driver)
+            lines = render(prev, cur, color)
+            if color:
+                sys.stdout.write(CLEAR)
+            sys.stdout.write('\n'.join(lines) + '\n\n')
+            sys.stdout.flush()
+            prev = cur
+            updates += 1
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == '__main__':
+    main()
@@ -1,11 +1,21 @@
 #!/usr/bin/env python3
 
+import fcntl
 import os
 import struct
 import sys
 
 fd = os.open(sys.argv[1], os.O_RDONLY)
 
+# struct xmm7360_trace_filter from rpc/xmm7360.h
+XMM7360_TRACE_DEFRAME = 1
+TRACE_FILTER_FMT = '<LL8L'
+_IOC_WRITE = 1
+_IOC_SIZE = struct.calcsize(TRACE_FILTER_FMT)
+XMM7360_IOCTL_SET_TRACE_FILTER = _IOC_WRITE << 30 | _IOC_SIZE << 16 | 0x78c2
+WANTED_STREAMS = [0]
+WANTED_TYPES = [0x10, 0x11]
+
 
 def log(msg):
     if 'shm_sensor' in msg:
@@ -99,6 +109,30 @@ def handle_packet(packet):
             log(decode_printf(payload))
 
 
+def kernel_deframe(fd):
+    '''Have the driver unescape records and drop unwanted ones'''
+    streams = 0
+    for stream in WANTED_STREAMS:
+        streams |= 1 << stream
+    types = [0] * 8
+    for typ in WANTED_TYPES:
+        types[typ // 32] |= 1 << (typ % 32)
+    arg = struct.pack(TRACE_FILTER_FMT, XMM7360_TRACE_DEFRAME, streams, *types)
+    try:
+        fcntl.ioctl(fd, XMM7360_IOCTL_SET_TRACE_FILTER, arg)
+    except OSError:
+        return False
+    return True
+
+
+if kernel_deframe(fd):
+    while True:
+        record = os.read(fd, 65536)
+        if not len(record):
+            break
+        handle_packet(record)
+    sys.exit(0)
+
 buf = b''
 
 while True:
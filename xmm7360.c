@@ -25,23 +25,38 @@
 #include <linux/version.h>
 #include <linux/cdev.h>
 #include <linux/delay.h>
+#include <linux/ethtool.h>
 #include <linux/hrtimer.h>
 #include <linux/if.h>
 #include <linux/if_arp.h>
 #include <linux/init.h>
 #include <linux/interrupt.h>
 #include <linux/kernel.h>
+#include <linux/kfifo.h>
 #include <linux/module.h>
 #include <linux/netdevice.h>
 #include <linux/pci.h>
 #include <linux/poll.h>
+#include <linux/pm_runtime.h>
 #include <linux/skbuff.h>
 #include <linux/tty.h>
 #include <linux/tty_flip.h>
 #include <linux/uaccess.h>
 #include <linux/wait.h>
 #include <linux/workqueue.h>
+#include <net/codel.h>
+#include <net/codel_impl.h>
+#include <net/inet_ecn.h>
+#include <net/ip.h>
+#include <net/ipv6.h>
 #include <net/rtnetlink.h>
+#include <net/sch_generic.h>
+#include <net/tcp.h>
+
+#include "xmm7360_coalesce.h"
+
+#define CREATE_TRACE_POINTS
+#include "xmm7360_trace.h"
 
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -55,7 +70,105 @@ static struct pci_device_id xmm7360_ids[] = { {
 
 MODULE_DEVICE_TABLE(pci, xmm7360_ids);
 
+static int ring_cache_ms = 10000;
+module_param(ring_cache_ms, int, 0644);
+MODULE_PARM_DESC(ring_cache_ms,
+		 "Keep ring memory of closed queue pairs: -1 always, 0 never, else for N ms");
+
+static unsigned int qlth_interval_us;
+module_param(qlth_interval_us, uint, 0644);
+MODULE_PARM_DESC(qlth_interval_us,
+		 "Report uplink queue level (QLTH) at most every N us, 0 disables");
+
+static bool qlth_ab;
+module_param(qlth_ab, bool, 0644);
+MODULE_PARM_DESC(qlth_ab,
+		 "Alternate QLTH on/off per traffic burst and record ramp-up time");
+
+static bool ack_filter;
+module_param(ack_filter, bool, 0644);
+MODULE_PARM_DESC(ack_filter,
+		 "Drop queued TCP ACKs superseded by a later ACK of the same flow");
+
+static bool codel = true;
+module_param(codel, bool, 0644);
+MODULE_PARM_DESC(codel, "Run CoDel on the uplink coalescing queue");
+
+static unsigned int codel_target_us = 5000;
+module_param(codel_target_us, uint, 0644);
+MODULE_PARM_DESC(codel_target_us, "CoDel target sojourn time in us");
+
+static unsigned int codel_interval_us = 100000;
+module_param(codel_interval_us, uint, 0644);
+MODULE_PARM_DESC(codel_interval_us, "CoDel interval in us");
+
+static bool codel_ecn = true;
+module_param(codel_ecn, bool, 0644);
+MODULE_PARM_DESC(codel_ecn, "ECN-mark instead of dropping ECT packets");
+
+static unsigned int pack_lookahead = 8;
+module_param(pack_lookahead, uint, 0644);
+MODULE_PARM_DESC(pack_lookahead,
+		 "Packets past a full frame considered for filling it, 0 disables");
+
+static int autosuspend_ms = -1;
+module_param(autosuspend_ms, int, 0444);
+MODULE_PARM_DESC(autosuspend_ms,
+		 "Runtime suspend the modem after this long idle, -1 disables");
+
+static unsigned int watchdog_ms = 1000;
+module_param(watchdog_ms, uint, 0644);
+MODULE_PARM_DESC(watchdog_ms,
+		 "Ring stall watchdog period; a ring is stalled after two, 0 disables");
+
+#define SELFTEST_MAX_FRAMES 1024
+
+static unsigned int selftest_frames = 256;
+module_param(selftest_frames, uint, 0644);
+MODULE_PARM_DESC(selftest_frames,
+		 "Frames pushed per ethtool -t pass, at most 1024");
+
 #define XMM7360_IOCTL_GET_PAGE_SIZE _IOC(_IOC_READ, 'x', 0xc0, sizeof(u32))
+#define XMM7360_IOCTL_RESET_QP _IO('x', 0xc1)
+
+// Trace cdev only; mirrored in rpc/xmm7360.h
+struct xmm7360_trace_filter {
+	u32 flags;
+	u32 streams; // bit n passes records from stream n
+	u32 types[8]; // bit n passes records of type n
+};
+
+#define XMM7360_TRACE_DEFRAME 1
+
+struct xmm7360_trace_stats {
+	u64 records;
+	u64 filtered;
+	u64 overruns; // record fifo full
+	u64 oversize;
+};
+
+#define XMM7360_IOCTL_SET_TRACE_FILTER                                         \
+	_IOW('x', 0xc2, struct xmm7360_trace_filter)
+#define XMM7360_IOCTL_GET_TRACE_STATS                                          \
+	_IOR('x', 0xc3, struct xmm7360_trace_stats)
+
+// RPC cdev only; arg is 0 or 1
+#define XMM7360_IOCTL_RPC_UNSOL _IO('x', 0xc4)
+
+#define RPC_UNSOL_CODES 512
+
+struct xmm7360_rpc_unsol_filter {
+	u32 codes[RPC_UNSOL_CODES / 32]; // bit n passes unsolicited code n
+};
+
+struct xmm7360_rpc_stats {
+	u64 filtered; // unsolicited messages not wanted
+	u64 dropped; // receive queue full
+};
+
+#define XMM7360_IOCTL_RPC_UNSOL_FILTER                                         \
+	_IOW('x', 0xc5, struct xmm7360_rpc_unsol_filter)
+#define XMM7360_IOCTL_RPC_GET_STATS _IOR('x', 0xc6, struct xmm7360_rpc_stats)
 
 static dev_t xmm_base;
 
@@ -162,9 +275,11 @@ struct control_page {
 
 /* There are 16 TD rings: a Tx and Rx ring for each queue pair */
 struct td_ring {
-	u8 depth;
+	u8 depth; // nonzero while the ring is open
+	u8 wptr; // ours; only copied to the control page by _publish
 	u8 last_handled;
 	u16 page_size;
+	u8 alloc_depth; // depth of the memory below, which may be cached
 
 	struct td_ring_entry *tds;
 	dma_addr_t tds_phys;
@@ -172,24 +287,121 @@ struct td_ring {
 	// One page of page_size per td
 	void **pages;
 	dma_addr_t *pages_phys;
+
+	// written on Tx rings, received on Rx rings; kept across reopens
+	u64 tds_done;
+	u64 bytes_done;
 };
 
 #define TD_MAX_PAGE_SIZE 16384
 
+/* Fields used on every read and write come first and share a cache line;
+ * the device registration state behind them is only touched at setup.
+ */
 struct queue_pair {
 	struct xmm_dev *xmm;
 	u8 depth;
 	u16 page_size;
-	struct cdev cdev;
-	struct tty_port port;
-	int tty_index;
-	int tty_needs_wake;
-	struct device dev;
 	int num;
 	int open;
+	int tty_needs_wake;
 	wait_queue_head_t wq;
 	struct mutex lock;
-	unsigned char user_buf[TD_MAX_PAGE_SIZE];
+	unsigned char *user_buf; // cdevs only, page_size bytes
+
+	struct cdev cdev ____cacheline_aligned_in_smp;
+	struct tty_port port;
+	int tty_index;
+	struct device dev;
+	struct delayed_work free_work;
+	struct xmm_trace_rx *trace; // trace cdev in deframing mode
+
+	// watchdog state, only touched by the watchdog work
+	u32 wd_tx_rptr;
+	unsigned long wd_tx_since;
+	int wd_level; // next recovery action if the Tx ring stays stalled
+	u32 wd_rx_handled;
+	bool wd_rx_pending;
+};
+
+#define TRACE_MAX_RECORD 16384
+#define TRACE_FIFO_SIZE 65536
+
+/* The trace port is a stream of HDLC-like records: each one is delimited
+ * by 0x7e, with 0x7e and 0x7d inside it sent as 0x7d followed by the byte
+ * xor 0x20. Byte 0 of a record is the stream and byte 7 the type.
+ */
+struct xmm_trace_rx {
+	struct mutex lock; // serialises readers against the filter ioctl
+	struct xmm7360_trace_filter filter;
+	bool enabled;
+
+	// record being reassembled, possibly across TDs
+	u8 *rec; // TRACE_MAX_RECORD bytes
+	unsigned int len;
+	bool synced; // a delimiter has been seen
+	bool escape;
+	bool oversize;
+
+	struct kfifo_rec_ptr_2 fifo; // one trace record per entry
+	struct xmm7360_trace_stats stats;
+};
+
+/* RPC messages start with a little-endian length, then the length again
+ * and the call code as ASN.1 integers, then a big-endian tid word.
+ * 0x11000100 marks a synchronous call or its response, 0x110001xx an
+ * asynchronous call with tid xx; anything else is unsolicited. The driver
+ * gives every open file its own receive queue and, since all clients
+ * number their calls alike, renumbers asynchronous tids on the way out.
+ *
+ * Synchronous calls carry nothing to match an answer to its call, so the
+ * driver relies on the modem answering them in the order they were made.
+ * A call that is never answered would shift every later answer to the
+ * wrong client, so when calls have been in flight for RPC_SYNC_TIMEOUT
+ * without any answer, the next call gives up on them.
+ */
+#define RPC_TID_BASE 0x11000100
+#define RPC_TID_OFFSET 16 // aligned: messages start a TD page or user_buf
+#define RPC_HDR_LEN 20
+#define RPC_RXQ_LEN 64
+#define RPC_SYNC_TIMEOUT (30 * HZ)
+
+struct xmm_rpc_tid {
+	u32 client; // id of the client that made the call, 0 if free
+	u8 tid; // as the client numbered it
+};
+
+struct xmm_rpc {
+	struct mutex lock; // clients joining and leaving, and writers
+	spinlock_t route_lock; // everything below; taken from the IRQ
+	struct list_head clients;
+	int users;
+	u32 next_client;
+	u8 next_tid;
+	struct xmm_rpc_tid tids[256];
+	// clients, in call order; 0 for one that has since closed
+	DECLARE_KFIFO(sync_waiters, u32, 64);
+	unsigned long sync_stamp; // jiffies of the last sync call or answer
+};
+
+/* An open cdev; all but qp are only used on the RPC queue pair */
+struct xmm_client {
+	struct queue_pair *qp;
+	struct list_head list;
+	u32 id;
+	// unsolicited codes to receive; higher codes are always passed
+	DECLARE_BITMAP(unsol, RPC_UNSOL_CODES);
+	struct sk_buff_head rxq;
+	struct xmm7360_rpc_stats stats;
+};
+
+struct xmm_wd_stats {
+	u64 tx_stalls;
+	u64 lost_irqs;
+	u64 rx_rearms;
+	u64 ring_flushes;
+	u64 qp_restarts;
+	u64 dev_reinits;
 };
 
 struct xmm_dev {
@@ -213,6 +425,34 @@ struct xmm_dev {
 	struct xmm_net *net;
 	struct net_device *netdev;
 
+	struct xmm_rpc rpc;
+
+	// last state reported through sysfs, only touched by state_work
+	struct work_struct state_work;
+	int last_state;
+	u32 last_asleep;
+	u8 last_qp_open;
+	bool state_ready; // the above are initialised
+
+	struct delayed_work wd_work;
+	bool wd_enabled;
+	bool wd_tx_timeout;
+	struct xmm_wd_stats wd_stats;
+
+	bool runtime_pm;
+	bool quiesced; // rings closed for suspend; open QPs kept for resume
+	bool awaiting_traffic;
+	ktime_t resume_start;
+
+	// ethtool self-test: irq0 stamps the first interrupt after arming
+	bool selftest_armed;
+	ktime_t selftest_irq;
+
+	// for the irqs and doorbells sysfs attributes. Doorbells are rung
+	// from several contexts, so that count may lose the odd increment.
+	u64 irqs;
+	u64 doorbells;
+
 	int error;
 	int card_num;
 	int num_ttys;
@@ -241,27 +481,120 @@ struct mux_next_header {
 	uint16_t pad;
 };
 
+/* Queue level table. Layout follows the IOSM QLTH table: a reserved word
+ * followed by a single entry giving the bytes the host has waiting.
+ */
+struct mux_queue_level {
+	uint32_t reserved;
+	uint32_t bytes;
+};
+
 #define MUX_MAX_PACKETS 64
 
+/* Bytes of a frame that cannot carry packet data when it holds a single
+ * packet: the ADBH header, the packet pad, alignment ahead of the ADTH tag
+ * and the ADTH table with one bounds entry.
+ */
+#define MUX_FRAME_OVERHEAD                                                     \
+	(sizeof(struct mux_first_header) + 16 + 3 +                            \
+	 sizeof(struct mux_next_header) + 4 + sizeof(struct mux_bounds))
+
+/* The QLTH tag that follows the ADTH table when qlth_interval_us is set.
+ * The MTU leaves room for it whether or not it is enabled, since that can
+ * change at any time.
+ */
+#define MUX_QLTH_SIZE                                                          \
+	(sizeof(struct mux_next_header) + sizeof(struct mux_queue_level))
+
 struct mux_frame {
 	int n_packets, n_bytes, max_size, sequence;
 	uint16_t *last_tag_length, *last_tag_next;
 	struct mux_bounds bounds[MUX_MAX_PACKETS];
-	uint8_t data[TD_MAX_PAGE_SIZE];
+	uint8_t *data; // max_size bytes
+};
+
+/* Burst bookkeeping for the QLTH A/B measurement mode. A burst starts
+ * when uplink traffic resumes after QLTH_AB_IDLE_MS of silence, and its
+ * ramp-up time is how long it takes to hand QLTH_AB_RAMP_BYTES to the
+ * modem.
+ */
+#define QLTH_AB_IDLE_MS 200
+#define QLTH_AB_RAMP_BYTES (256 * 1024)
+
+/* Log2 histogram of uplink queue sojourn times; bucket n counts packets
+ * that waited less than 2^n us.
+ */
+#define SOJOURN_BUCKETS 24
+
+struct xmm_net_stats {
+	u64 qlth_tags;
+	u64 qlth_ab_bursts[2];
+	u64 qlth_ab_ramp_us[2];
+	u64 ack_filter_acks;
+	u64 ack_filter_dropped;
+	u64 codel_drops;
+	u64 codel_ecn_marks;
+	u64 sojourn_p50_us;
+	u64 sojourn_p90_us;
+	u64 sojourn_p99_us;
+	u64 sojourn_max_us;
+	u64 tx_frames;
+	u64 tx_frame_packets;
+	u64 tx_frame_bytes;
+	u64 tx_frame_unused_bytes;
+	u64 pack_lookahead_picks;
+	u64 ring_resets;
+	u64 resumes;
+	u64 resume_us;
+	u64 resume_to_traffic_us;
+	u64 tx_timeouts;
+	u64 wd_tx_stalls;
+	u64 wd_lost_irqs;
+	u64 wd_rx_rearms;
+	u64 wd_ring_flushes;
+	u64 wd_qp_restarts;
+	u64 wd_dev_reinits;
+};
+
+struct xmm7360_skb_cb {
+	ktime_t enqueued;
+	bool ack_counted; // in ack_filter_acks; the filter sees it per flush
 };
 
+#define XMM7360_SKB_CB(skb) ((struct xmm7360_skb_cb *)(skb)->cb)
+
+/* Laid out by who writes what. The first block is set up once and read
+ * from every CPU. Everything behind the lock is written by whichever CPU
+ * holds it: xmit, the deadline timer or the flush from the IRQ handler.
+ * The Rx path only reads the first block and the netdev stats. The mux
+ * frame buffer itself is allocated separately.
+ */
 struct xmm_net {
 	struct xmm_dev *xmm;
 	struct queue_pair *qp;
 	int channel;
 
+	// Tx, all under lock
+	spinlock_t lock ____cacheline_aligned_in_smp;
+	const struct xmm7360_coalesce_ops *coalesce;
 	struct sk_buff_head queue;
-	struct hrtimer deadline;
-	int queued_packets, queued_bytes;
-
+	int queued_packets, overflow_packets;
+	u32 queued_bytes;
 	int sequence;
-	spinlock_t lock;
+	struct codel_params cparams; // refreshed from the params per dequeue
+	struct codel_vars cvars;
+	struct work_struct reset_work; // scheduled when a frame fails to ship
+	ktime_t qlth_last;
+	ktime_t last_tx, burst_start;
+	int burst_bytes, burst_arm;
+	bool burst_ramping;
 	struct mux_frame frame;
+	struct codel_stats cstats;
+	u32 sojourn_hist[SOJOURN_BUCKETS];
+	struct xmm_net_stats stats;
+
+	// armed from xmit without the lock, and run on the timer's CPU
+	struct hrtimer deadline ____cacheline_aligned_in_smp;
 };
 
 static void xmm7360_poll(struct xmm_dev *xmm)
@@ -276,11 +609,198 @@ static void xmm7360_poll(struct xmm_dev *xmm)
 	}
 }
 
+enum xmm_state {
+	XMM_STATE_BOOTING,
+	XMM_STATE_READY,
+	XMM_STATE_CRASHED,
+	XMM_STATE_ERROR,
+	XMM_STATE_SUSPENDED,
+};
+
+static const char *const xmm7360_state_names[] = {
+	[XMM_STATE_BOOTING] = "booting",
+	[XMM_STATE_READY] = "ready",
+	[XMM_STATE_CRASHED] = "crashed",
+	[XMM_STATE_ERROR] = "error",
+	[XMM_STATE_SUSPENDED] = "suspended",
+};
+
+static int xmm7360_state(struct xmm_dev *xmm)
+{
+	u32 status;
+
+	/* The BARs may not be readable while suspended */
+	if (READ_ONCE(xmm->quiesced))
+		return XMM_STATE_SUSPENDED;
+	if (xmm->cp && xmm->cp->status.code == 0xbadc0ded)
+		return XMM_STATE_CRASHED;
+
+	status = xmm->bar2[BAR2_STATUS];
+	if (status == 0xfeedb007)
+		return XMM_STATE_BOOTING;
+	if (status == 0x600df00d && !xmm->error)
+		return XMM_STATE_READY;
+	return XMM_STATE_ERROR;
+}
+
+static u32 xmm7360_asleep(struct xmm_dev *xmm)
+{
+	if (READ_ONCE(xmm->quiesced))
+		return 1;
+	return xmm->cp ? xmm->cp->status.asleep : 0;
+}
+
+static u8 xmm7360_qp_open_mask(struct xmm_dev *xmm)
+{
+	u8 mask = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		if (xmm->qp[i].xmm && xmm->qp[i].open)
+			mask |= BIT(i);
+	return mask;
+}
+
+/* Wake sysfs pollers for every attribute that changed since the last run,
+ * and send a uevent when the modem state itself changes.
+ */
+static void xmm7360_state_work(struct work_struct *work)
+{
+	struct xmm_dev *xmm = container_of(work, struct xmm_dev, state_work);
+	struct kobject *kobj = &xmm->dev->kobj;
+	int state = xmm7360_state(xmm);
+	u32 asleep = xmm7360_asleep(xmm);
+	u8 qp_open = xmm7360_qp_open_mask(xmm);
+	char env[32];
+	char *envp[] = { env, NULL };
+
+	if (asleep != xmm->last_asleep) {
+		xmm->last_asleep = asleep;
+		sysfs_notify(kobj, NULL, "asleep");
+	}
+
+	if (qp_open != xmm->last_qp_open) {
+		xmm->last_qp_open = qp_open;
+		sysfs_notify(kobj, NULL, "qp_open");
+	}
+
+	if (state != xmm->last_state) {
+		dev_info(xmm->dev, "state %s -> %s\n",
+			 xmm7360_state_names[xmm->last_state],
+			 xmm7360_state_names[state]);
+		xmm->last_state = state;
+		sysfs_notify(kobj, NULL, "state");
+		snprintf(env, sizeof(env), "XMM7360_STATE=%s",
+			 xmm7360_state_names[state]);
+		kobject_uevent_env(kobj, KOBJ_CHANGE, envp);
+	}
+}
+
+static void xmm7360_state_changed(struct xmm_dev *xmm)
+{
+	if (READ_ONCE(xmm->state_ready))
+		schedule_work(&xmm->state_work);
+}
+
+static ssize_t state_show(struct device *dev, struct device_attribute *attr,
+			  char *buf)
+{
+	struct xmm_dev *xmm = dev_get_drvdata(dev);
+	return sprintf(buf, "%s\n", xmm7360_state_names[xmm7360_state(xmm)]);
+}
+static DEVICE_ATTR_RO(state);
+
+static ssize_t asleep_show(struct device *dev, struct device_attribute *attr,
+			   char *buf)
+{
+	struct xmm_dev *xmm = dev_get_drvdata(dev);
+	return sprintf(buf, "%u\n", xmm7360_asleep(xmm) ? 1 : 0);
+}
+static DEVICE_ATTR_RO(asleep);
+
+/* Numbers of the open queue pairs, space separated */
+static ssize_t qp_open_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct xmm_dev *xmm = dev_get_drvdata(dev);
+	u8 mask = xmm7360_qp_open_mask(xmm);
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		if (mask & BIT(i))
+			len += sprintf(buf + len, len ? " %d" : "%d", i);
+	len += sprintf(buf + len, "\n");
+	return len;
+}
+static DEVICE_ATTR_RO(qp_open);
+
+static ssize_t irqs_show(struct device *dev, struct device_attribute *attr,
+			 char *buf)
+{
+	struct xmm_dev *xmm = dev_get_drvdata(dev);
+	return sprintf(buf, "%llu\n", READ_ONCE(xmm->irqs));
+}
+static DEVICE_ATTR_RO(irqs);
+
+static ssize_t doorbells_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct xmm_dev *xmm = dev_get_drvdata(dev);
+	return sprintf(buf, "%llu\n", READ_ONCE(xmm->doorbells));
+}
+static DEVICE_ATTR_RO(doorbells);
+
+/* One line per open TD ring: ring number, depth, host and modem pointers,
+ * then the TDs and bytes that have passed through it. Even rings are Tx,
+ * odd rings Rx; ring n belongs to queue pair n / 2.
+ */
+static ssize_t rings_show(struct device *dev, struct device_attribute *attr,
+			  char *buf)
+{
+	struct xmm_dev *xmm = dev_get_drvdata(dev);
+	struct td_ring *ring;
+	ssize_t len = 0;
+	u8 depth;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(xmm->td_ring); i++) {
+		ring = &xmm->td_ring[i];
+		depth = READ_ONCE(ring->depth);
+		if (!depth)
+			continue;
+		len += sprintf(buf + len, "%d %u %u %u %llu %llu\n", i, depth,
+			       READ_ONCE(ring->wptr),
+			       READ_ONCE(xmm->cp->s_rptr[i]),
+			       READ_ONCE(ring->tds_done),
+			       READ_ONCE(ring->bytes_done));
+	}
+	return len;
+}
+static DEVICE_ATTR_RO(rings);
+
+static struct attribute *xmm7360_attrs[] = {
+	&dev_attr_state.attr,
+	&dev_attr_asleep.attr,
+	&dev_attr_qp_open.attr,
+	&dev_attr_irqs.attr,
+	&dev_attr_doorbells.attr,
+	&dev_attr_rings.attr,
+	NULL,
+};
+/* Created by the driver core once probe succeeds, before the uevent; by
+ * probe itself on kernels without dev_groups.
+ */
+ATTRIBUTE_GROUPS(xmm7360);
+
 static void xmm7360_ding(struct xmm_dev *xmm, int bell)
 {
+	/* Ring and index updates must reach memory before the doorbell */
+	wmb();
 	if (xmm->cp->status.asleep)
 		xmm->bar0[BAR0_WAKEUP] = 1;
 	xmm->bar0[BAR0_DOORBELL] = bell;
+	xmm->doorbells++;
 	xmm7360_poll(xmm);
 }
 
@@ -315,6 +835,7 @@ static int xmm7360_cmd_ring_execute(struct xmm_dev *xmm, u8 cmd, u8 parm,
 	xmm->cp->c_ring[wptr].unk = 0;
 	xmm->cp->c_ring[wptr].flags = CMD_FLAG_READY;
 
+	dma_wmb();
 	xmm->cp->c_wptr = new_wptr;
 
 	xmm7360_ding(xmm, DOORBELL_CMD);
@@ -326,8 +847,15 @@ static int xmm7360_cmd_ring_init(struct xmm_dev *xmm)
 	int timeout;
 	int ret;
 
-	xmm->cp = dma_alloc_coherent(xmm->dev, sizeof(struct control_page),
-				     &xmm->cp_phys, GFP_KERNEL);
+	/* On resume the control page from probe is reused */
+	if (!xmm->cp) {
+		xmm->cp = dma_alloc_coherent(xmm->dev,
+					     sizeof(struct control_page),
+					     &xmm->cp_phys, GFP_KERNEL);
+		if (!xmm->cp)
+			return -ENOMEM;
+	}
+	memset((void *)xmm->cp, 0, sizeof(struct control_page));
 
 	xmm->cp->ctl.status =
 		xmm->cp_phys + offsetof(struct control_page, status);
@@ -388,48 +916,140 @@ static void xmm7360_cmd_ring_free(struct xmm_dev *xmm)
 	return;
 }
 
-static int xmm7360_td_ring_create(struct xmm_dev *xmm, u8 ring_id, u8 depth,
-				  u16 page_size)
+/* Have the modem discard everything on a ring without giving up its
+ * memory. The caller rewinds the ring pointers afterwards.
+ */
+static int xmm7360_td_ring_flush(struct xmm_dev *xmm, u8 ring_id)
+{
+	if (!xmm->td_ring[ring_id].depth)
+		return -ENODEV;
+
+	return xmm7360_cmd_ring_execute(xmm, CMD_RING_FLUSH, ring_id, 0, 0, 0);
+}
+
+static void xmm7360_td_ring_rewind(struct xmm_dev *xmm, u8 ring_id)
+{
+	xmm->cp->s_rptr[ring_id] = xmm->cp->s_wptr[ring_id] = 0;
+	xmm->td_ring[ring_id].wptr = 0;
+	xmm->td_ring[ring_id].last_handled = 0;
+}
+
+static void xmm7360_td_ring_free(struct xmm_dev *xmm, u8 ring_id)
 {
 	struct td_ring *ring = &xmm->td_ring[ring_id];
 	int i;
-	int ret;
 
-	BUG_ON(ring->depth);
-	BUG_ON(depth & (depth - 1));
-	BUG_ON(page_size > TD_MAX_PAGE_SIZE);
+	if (!ring->alloc_depth)
+		return;
+
+	/* A failed alloc may have left either array unallocated */
+	if (ring->pages && ring->pages_phys) {
+		for (i = 0; i < ring->alloc_depth; i++) {
+			if (!ring->pages[i])
+				continue;
+			dma_free_coherent(xmm->dev, ring->page_size,
+					  ring->pages[i], ring->pages_phys[i]);
+		}
+	}
+
+	kfree(ring->pages_phys);
+	kfree(ring->pages);
+
+	dma_free_coherent(xmm->dev,
+			  sizeof(struct td_ring_entry) * ring->alloc_depth,
+			  ring->tds, ring->tds_phys);
+
+	ring->tds = NULL;
+	ring->pages = NULL;
+	ring->pages_phys = NULL;
+	ring->alloc_depth = 0;
+}
+
+/* Ring memory outlives the ring itself, so reopening a recently closed
+ * queue pair reuses what is already there.
+ */
+static int xmm7360_td_ring_alloc(struct xmm_dev *xmm, u8 ring_id, u8 depth,
+				 u16 page_size)
+{
+	struct td_ring *ring = &xmm->td_ring[ring_id];
+	int node = dev_to_node(xmm->dev);
+	int i;
+
+	if (ring->alloc_depth == depth && ring->page_size == page_size)
+		return 0;
+
+	xmm7360_td_ring_free(xmm, ring_id);
 
-	memset(ring, 0, sizeof(struct td_ring));
-	ring->depth = depth;
 	ring->page_size = page_size;
 	ring->tds = dma_alloc_coherent(xmm->dev,
 				       sizeof(struct td_ring_entry) * depth,
 				       &ring->tds_phys, GFP_KERNEL);
+	if (!ring->tds)
+		return -ENOMEM;
 
-	ring->pages = kzalloc(sizeof(void *) * depth, GFP_KERNEL);
-	ring->pages_phys = kzalloc(sizeof(dma_addr_t) * depth, GFP_KERNEL);
+	ring->pages = kcalloc_node(depth, sizeof(void *), GFP_KERNEL, node);
+	ring->pages_phys =
+		kcalloc_node(depth, sizeof(dma_addr_t), GFP_KERNEL, node);
+	ring->alloc_depth = depth;
+	if (!ring->pages || !ring->pages_phys)
+		goto fail;
 
 	for (i = 0; i < depth; i++) {
 		ring->pages[i] = dma_alloc_coherent(xmm->dev, ring->page_size,
 						    &ring->pages_phys[i],
 						    GFP_KERNEL);
-		ring->tds[i].addr = ring->pages_phys[i];
+		if (!ring->pages[i])
+			goto fail;
 	}
 
+	return 0;
+
+fail:
+	xmm7360_td_ring_free(xmm, ring_id);
+	return -ENOMEM;
+}
+
+static int xmm7360_td_ring_create(struct xmm_dev *xmm, u8 ring_id, u8 depth,
+				  u16 page_size)
+{
+	struct td_ring *ring = &xmm->td_ring[ring_id];
+	int i;
+	int ret;
+
+	BUG_ON(ring->depth);
+	BUG_ON(depth & (depth - 1));
+	BUG_ON(page_size > TD_MAX_PAGE_SIZE);
+
+	ret = xmm7360_td_ring_alloc(xmm, ring_id, depth, page_size);
+	if (ret)
+		return ret;
+
+	memset(ring->tds, 0, sizeof(struct td_ring_entry) * depth);
+	for (i = 0; i < depth; i++)
+		ring->tds[i].addr = ring->pages_phys[i];
+
+	ring->depth = depth;
+	ring->wptr = 0;
+	ring->last_handled = 0;
+
 	xmm->cp->s_rptr[ring_id] = xmm->cp->s_wptr[ring_id] = 0;
 	ret = xmm7360_cmd_ring_execute(xmm, CMD_RING_OPEN, ring_id, depth,
 				       ring->tds_phys, 0x60);
-	if (ret)
+	if (ret) {
+		ring->depth = 0;
 		return ret;
+	}
 	return 0;
 }
 
+/* Close the ring on the modem side. Its memory is released according to
+ * the ring_cache_ms policy.
+ */
 static void xmm7360_td_ring_destroy(struct xmm_dev *xmm, u8 ring_id)
 {
 	struct td_ring *ring = &xmm->td_ring[ring_id];
-	int i, depth = ring->depth;
 
-	if (!depth) {
+	if (!ring->depth) {
 		WARN_ON(1);
 		dev_err(xmm->dev, "Tried destroying empty ring!\n");
 		return;
@@ -437,25 +1057,39 @@ static void xmm7360_td_ring_destroy(struct xmm_dev *xmm, u8 ring_id)
 
 	xmm7360_cmd_ring_execute(xmm, CMD_RING_CLOSE, ring_id, 0, 0, 0);
 
-	for (i = 0; i < depth; i++) {
-		dma_free_coherent(xmm->dev, ring->page_size, ring->pages[i],
-				  ring->pages_phys[i]);
-	}
+	ring->depth = 0;
+}
 
-	kfree(ring->pages_phys);
-	kfree(ring->pages);
+/* Snapshot the modem's read pointer. Every TD before it is complete. */
+static u8 xmm7360_td_ring_rptr(struct xmm_dev *xmm, u8 ring_id)
+{
+	u8 rptr = READ_ONCE(xmm->cp->s_rptr[ring_id]);
 
-	dma_free_coherent(xmm->dev, sizeof(struct td_ring_entry) * depth,
-			  ring->tds, ring->tds_phys);
+	/* Don't look at TD contents until the index covering them is seen */
+	dma_rmb();
+	return rptr;
+}
 
-	ring->depth = 0;
+/* Hand every TD queued by _write or _read since the last publish to the
+ * modem. The caller rings DOORBELL_TD afterwards.
+ */
+static void xmm7360_td_ring_publish(struct xmm_dev *xmm, u8 ring_id)
+{
+	dma_wmb();
+	WRITE_ONCE(xmm->cp->s_wptr[ring_id], xmm->td_ring[ring_id].wptr);
+}
+
+static void xmm7360_td_ring_account(struct td_ring *ring, unsigned int len)
+{
+	ring->tds_done++;
+	ring->bytes_done += len;
 }
 
 static void xmm7360_td_ring_write(struct xmm_dev *xmm, u8 ring_id,
 				  const void *buf, int len)
 {
 	struct td_ring *ring = &xmm->td_ring[ring_id];
-	u8 wptr = xmm->cp->s_wptr[ring_id];
+	u8 wptr = ring->wptr;
 
 	BUG_ON(!ring->depth);
 	BUG_ON(len > ring->page_size);
@@ -467,23 +1101,23 @@ static void xmm7360_td_ring_write(struct xmm_dev *xmm, u8 ring_id,
 	ring->tds[wptr].unk = 0;
 
 	wptr = (wptr + 1) & (ring->depth - 1);
-	BUG_ON(wptr == xmm->cp->s_rptr[ring_id]);
+	BUG_ON(wptr == READ_ONCE(xmm->cp->s_rptr[ring_id]));
 
-	xmm->cp->s_wptr[ring_id] = wptr;
+	ring->wptr = wptr;
+	xmm7360_td_ring_account(ring, len);
 }
 
 static int xmm7360_td_ring_full(struct xmm_dev *xmm, u8 ring_id)
 {
 	struct td_ring *ring = &xmm->td_ring[ring_id];
-	u8 wptr = xmm->cp->s_wptr[ring_id];
-	wptr = (wptr + 1) & (ring->depth - 1);
-	return wptr == xmm->cp->s_rptr[ring_id];
+	u8 wptr = (ring->wptr + 1) & (ring->depth - 1);
+	return wptr == READ_ONCE(xmm->cp->s_rptr[ring_id]);
 }
 
 static void xmm7360_td_ring_read(struct xmm_dev *xmm, u8 ring_id)
 {
 	struct td_ring *ring = &xmm->td_ring[ring_id];
-	u8 wptr = xmm->cp->s_wptr[ring_id];
+	u8 wptr = ring->wptr;
 
 	if (!ring->depth) {
 		dev_err(xmm->dev, "read on disabled ring\n");
@@ -501,9 +1135,26 @@ static void xmm7360_td_ring_read(struct xmm_dev *xmm, u8 ring_id)
 	ring->tds[wptr].unk = 0;
 
 	wptr = (wptr + 1) & (ring->depth - 1);
-	BUG_ON(wptr == xmm->cp->s_rptr[ring_id]);
+	BUG_ON(wptr == READ_ONCE(xmm->cp->s_rptr[ring_id]));
+
+	ring->wptr = wptr;
+}
 
-	xmm->cp->s_wptr[ring_id] = wptr;
+static void xmm7360_qp_free_rings(struct queue_pair *qp)
+{
+	xmm7360_td_ring_free(qp->xmm, qp->num * 2);
+	xmm7360_td_ring_free(qp->xmm, qp->num * 2 + 1);
+}
+
+static void xmm7360_qp_free_work(struct work_struct *work)
+{
+	struct queue_pair *qp =
+		container_of(to_delayed_work(work), struct queue_pair, free_work);
+
+	mutex_lock(&qp->lock);
+	if (!qp->open)
+		xmm7360_qp_free_rings(qp);
+	mutex_unlock(&qp->lock);
 }
 
 static struct queue_pair *xmm7360_init_qp(struct xmm_dev *xmm, int num,
@@ -519,46 +1170,89 @@ static struct queue_pair *xmm7360_init_qp(struct xmm_dev *xmm, int num,
 
 	mutex_init(&qp->lock);
 	init_waitqueue_head(&qp->wq);
+	INIT_DELAYED_WORK(&qp->free_work, xmm7360_qp_free_work);
 	return qp;
 }
 
-static int xmm7360_qp_start(struct queue_pair *qp)
+/* Users of a queue pair hold the device out of runtime suspend */
+static int xmm7360_pm_get(struct xmm_dev *xmm)
+{
+	int ret = pm_runtime_get_sync(xmm->dev);
+	if (ret < 0) {
+		pm_runtime_put_noidle(xmm->dev);
+		return ret;
+	}
+	return 0;
+}
+
+static void xmm7360_pm_put(struct xmm_dev *xmm)
+{
+	pm_runtime_mark_last_busy(xmm->dev);
+	pm_runtime_put_autosuspend(xmm->dev);
+}
+
+static int xmm7360_qp_open_rings(struct queue_pair *qp)
 {
 	struct xmm_dev *xmm = qp->xmm;
 	int ret;
 
-	mutex_lock(&qp->lock);
+	ret = xmm7360_td_ring_create(xmm, qp->num * 2, qp->depth,
+				     qp->page_size);
+	if (ret)
+		return ret;
+	ret = xmm7360_td_ring_create(xmm, qp->num * 2 + 1, qp->depth,
+				     qp->page_size);
+	if (ret) {
+		xmm7360_td_ring_destroy(xmm, qp->num * 2);
+		return ret;
+	}
+	while (!xmm7360_td_ring_full(xmm, qp->num * 2 + 1))
+		xmm7360_td_ring_read(xmm, qp->num * 2 + 1);
+	xmm7360_td_ring_publish(xmm, qp->num * 2 + 1);
+	xmm7360_ding(xmm, DOORBELL_TD);
+	return 0;
+}
 
-	if (qp->open) {
-		ret = -EBUSY;
+static void xmm7360_qp_close_rings(struct queue_pair *qp)
+{
+	struct xmm_dev *xmm = qp->xmm;
+
+	/* A failed restart can leave either ring closed */
+	if (xmm->td_ring[qp->num * 2].depth)
+		xmm7360_td_ring_destroy(xmm, qp->num * 2);
+	if (xmm->td_ring[qp->num * 2 + 1].depth)
+		xmm7360_td_ring_destroy(xmm, qp->num * 2 + 1);
+}
+
+static int xmm7360_qp_start(struct queue_pair *qp)
+{
+	int ret;
+
+	/* The rings are about to be reused; don't let them be freed */
+	cancel_delayed_work_sync(&qp->free_work);
+
+	mutex_lock(&qp->lock);
+
+	if (qp->open) {
+		ret = -EBUSY;
 	} else {
-		ret = 0;
 		qp->open = 1;
-
-		ret = xmm7360_td_ring_create(xmm, qp->num * 2, qp->depth,
-					     qp->page_size);
+		ret = xmm7360_qp_open_rings(qp);
 		if (ret)
-			goto out;
-		ret = xmm7360_td_ring_create(xmm, qp->num * 2 + 1, qp->depth,
-					     qp->page_size);
-		if (ret) {
-			xmm7360_td_ring_destroy(xmm, qp->num * 2);
-			goto out;
-		}
-		while (!xmm7360_td_ring_full(xmm, qp->num * 2 + 1))
-			xmm7360_td_ring_read(xmm, qp->num * 2 + 1);
-		xmm7360_ding(xmm, DOORBELL_TD);
+			qp->open = 0;
 	}
 
-out:
 	mutex_unlock(&qp->lock);
 
+	if (!ret)
+		xmm7360_state_changed(qp->xmm);
+
 	return ret;
 }
 
 static int xmm7360_qp_stop(struct queue_pair *qp)
 {
-	struct xmm_dev *xmm = qp->xmm;
+	int cache_ms;
 	int ret = 0;
 
 	mutex_lock(&qp->lock);
@@ -568,8 +1262,86 @@ static int xmm7360_qp_stop(struct queue_pair *qp)
 		ret = 0;
 		qp->open = 0;
 
-		xmm7360_td_ring_destroy(xmm, qp->num * 2);
-		xmm7360_td_ring_destroy(xmm, qp->num * 2 + 1);
+		/* Suspend already closed the rings */
+		if (!READ_ONCE(qp->xmm->quiesced))
+			xmm7360_qp_close_rings(qp);
+
+		cache_ms = READ_ONCE(ring_cache_ms);
+		if (!cache_ms)
+			xmm7360_qp_free_rings(qp);
+		else if (cache_ms > 0)
+			mod_delayed_work(system_wq, &qp->free_work,
+					 msecs_to_jiffies(cache_ms));
+	}
+	mutex_unlock(&qp->lock);
+
+	if (!ret)
+		xmm7360_state_changed(qp->xmm);
+	return ret;
+}
+
+/* Recover a wedged queue pair by flushing both of its rings and re-arming
+ * the Rx TDs, rather than closing and reallocating them.
+ */
+static int xmm7360_qp_reset(struct queue_pair *qp)
+{
+	struct xmm_dev *xmm = qp->xmm;
+	int ret;
+
+	mutex_lock(&qp->lock);
+	if (!qp->open) {
+		ret = -ENODEV;
+		goto out;
+	}
+	if (READ_ONCE(xmm->quiesced)) {
+		ret = -EAGAIN;
+		goto out;
+	}
+
+	ret = xmm7360_td_ring_flush(xmm, qp->num * 2);
+	if (ret)
+		goto out;
+	ret = xmm7360_td_ring_flush(xmm, qp->num * 2 + 1);
+	if (ret)
+		goto out;
+
+	/* Keep the IRQ handler off the rings while they are rewound */
+	disable_irq(xmm->irq);
+	xmm7360_td_ring_rewind(xmm, qp->num * 2);
+	xmm7360_td_ring_rewind(xmm, qp->num * 2 + 1);
+	while (!xmm7360_td_ring_full(xmm, qp->num * 2 + 1))
+		xmm7360_td_ring_read(xmm, qp->num * 2 + 1);
+	xmm7360_td_ring_publish(xmm, qp->num * 2 + 1);
+	if (qp->num == 1) {
+		/* Calls in flight will never be answered */
+		spin_lock(&xmm->rpc.route_lock);
+		kfifo_reset(&xmm->rpc.sync_waiters);
+		spin_unlock(&xmm->rpc.route_lock);
+	}
+	enable_irq(xmm->irq);
+
+	xmm7360_ding(xmm, DOORBELL_TD);
+
+out:
+	mutex_unlock(&qp->lock);
+	return ret;
+}
+
+/* Close and reopen both rings of a queue pair, for when a flush is not
+ * enough to get the modem consuming them again.
+ */
+static int xmm7360_qp_restart(struct queue_pair *qp)
+{
+	int ret;
+
+	mutex_lock(&qp->lock);
+	if (!qp->open) {
+		ret = -ENODEV;
+	} else if (READ_ONCE(qp->xmm->quiesced)) {
+		ret = -EAGAIN;
+	} else {
+		xmm7360_qp_close_rings(qp);
+		ret = xmm7360_qp_open_rings(qp);
 	}
 	mutex_unlock(&qp->lock);
 	return ret;
@@ -578,6 +1350,8 @@ static int xmm7360_qp_stop(struct queue_pair *qp)
 static int xmm7360_qp_can_write(struct queue_pair *qp)
 {
 	struct xmm_dev *xmm = qp->xmm;
+	if (READ_ONCE(xmm->quiesced) || !xmm->td_ring[qp->num * 2].depth)
+		return 0;
 	return !xmm7360_td_ring_full(xmm, qp->num * 2);
 }
 
@@ -593,6 +1367,7 @@ static size_t xmm7360_qp_write(struct queue_pair *qp, const char *buf,
 	if (size > page_size)
 		size = page_size;
 	xmm7360_td_ring_write(xmm, qp->num * 2, buf, size);
+	xmm7360_td_ring_publish(xmm, qp->num * 2);
 	xmm7360_ding(xmm, DOORBELL_TD);
 	return size;
 }
@@ -617,7 +1392,10 @@ static int xmm7360_qp_has_data(struct queue_pair *qp)
 {
 	struct xmm_dev *xmm = qp->xmm;
 	struct td_ring *ring = &xmm->td_ring[qp->num * 2 + 1];
-	return xmm->cp->s_rptr[qp->num * 2 + 1] != ring->last_handled;
+	if (!ring->depth)
+		return 0;
+	return READ_ONCE(xmm->cp->s_rptr[qp->num * 2 + 1]) !=
+	       ring->last_handled;
 }
 
 static void xmm7360_tty_poll_qp(struct queue_pair *qp)
@@ -625,105 +1403,296 @@ static void xmm7360_tty_poll_qp(struct queue_pair *qp)
 	struct xmm_dev *xmm = qp->xmm;
 	struct td_ring *ring = &xmm->td_ring[qp->num * 2 + 1];
 	int idx, nread;
-	while (xmm7360_qp_has_data(qp)) {
-		idx = ring->last_handled;
-		nread = ring->tds[idx].length;
-		tty_insert_flip_string(&qp->port, ring->pages[idx], nread);
-		tty_flip_buffer_push(&qp->port);
+	u8 rptr;
 
-		xmm7360_td_ring_read(xmm, qp->num * 2 + 1);
+	if (!ring->depth)
+		return;
+
+	/* Drain whatever has completed, then hand the TDs back in one go */
+	while ((rptr = xmm7360_td_ring_rptr(xmm, qp->num * 2 + 1)) !=
+	       ring->last_handled) {
+		do {
+			idx = ring->last_handled;
+			nread = ring->tds[idx].length;
+			tty_insert_flip_string(&qp->port, ring->pages[idx],
+					       nread);
+			xmm7360_td_ring_account(ring, nread);
+			xmm7360_td_ring_read(xmm, qp->num * 2 + 1);
+			ring->last_handled = (idx + 1) & (ring->depth - 1);
+		} while (ring->last_handled != rptr);
+
+		tty_flip_buffer_push(&qp->port);
+		xmm7360_td_ring_publish(xmm, qp->num * 2 + 1);
 		xmm7360_ding(xmm, DOORBELL_TD);
-		ring->last_handled = (idx + 1) & (ring->depth - 1);
 	}
 }
 
-int xmm7360_cdev_open(struct inode *inode, struct file *file)
+static bool xmm7360_word_has_byte(unsigned long w, unsigned long pat)
 {
-	struct queue_pair *qp =
-		container_of(inode->i_cdev, struct queue_pair, cdev);
-	file->private_data = qp;
-	return xmm7360_qp_start(qp);
+	w ^= pat;
+	return (w - REPEAT_BYTE(0x01)) & ~w & REPEAT_BYTE(0x80);
 }
 
-int xmm7360_cdev_release(struct inode *inode, struct file *file)
+/* Length of the leading run of bytes that are neither a delimiter nor an
+ * escape, scanned a word at a time once p is aligned.
+ */
+static size_t xmm7360_trace_span(const u8 *p, size_t len)
 {
-	struct queue_pair *qp = file->private_data;
-	return xmm7360_qp_stop(qp);
+	size_t i = 0;
+	unsigned long w;
+
+	while (i < len && !IS_ALIGNED((unsigned long)(p + i), sizeof(w))) {
+		if (p[i] == 0x7e || p[i] == 0x7d)
+			return i;
+		i++;
+	}
+
+	while (i + sizeof(w) <= len) {
+		w = *(const unsigned long *)(p + i);
+		if (xmm7360_word_has_byte(w, REPEAT_BYTE(0x7e)) ||
+		    xmm7360_word_has_byte(w, REPEAT_BYTE(0x7d)))
+			break;
+		i += sizeof(w);
+	}
+
+	while (i < len && p[i] != 0x7e && p[i] != 0x7d)
+		i++;
+	return i;
 }
 
-ssize_t xmm7360_cdev_write(struct file *file, const char __user *buf,
-			   size_t size, loff_t *offset)
+static void xmm7360_trace_append(struct xmm_trace_rx *tr, const u8 *p,
+				 size_t len)
 {
-	struct queue_pair *qp = file->private_data;
-	int ret;
+	if (tr->oversize || tr->len + len > TRACE_MAX_RECORD) {
+		tr->oversize = true;
+		return;
+	}
+	memcpy(tr->rec + tr->len, p, len);
+	tr->len += len;
+}
 
-	ret = xmm7360_qp_write_user(qp, buf, size);
-	if (ret < 0)
-		return ret;
+static bool xmm7360_trace_wanted(struct xmm_trace_rx *tr)
+{
+	u8 stream, type;
+
+	if (tr->len < 8)
+		return false;
+	stream = tr->rec[0];
+	type = tr->rec[7];
+	if (stream >= 32 || !(tr->filter.streams & BIT(stream)))
+		return false;
+	return tr->filter.types[type / 32] & BIT(type % 32);
+}
 
-	*offset += ret;
-	return size;
+static void xmm7360_trace_end_record(struct xmm_trace_rx *tr)
+{
+	if (!tr->len && !tr->oversize)
+		return;
+
+	if (tr->oversize)
+		tr->stats.oversize++;
+	else if (!xmm7360_trace_wanted(tr))
+		tr->stats.filtered++;
+	else if (kfifo_avail(&tr->fifo) < tr->len)
+		tr->stats.overruns++;
+	else {
+		kfifo_in(&tr->fifo, tr->rec, tr->len);
+		tr->stats.records++;
+	}
+
+	tr->len = 0;
+	tr->escape = false;
+	tr->oversize = false;
 }
 
-ssize_t xmm7360_cdev_read(struct file *file, char __user *buf, size_t size,
-			  loff_t *offset)
+static void xmm7360_trace_feed(struct xmm_trace_rx *tr, const u8 *p,
+			       size_t len)
+{
+	const u8 *delim;
+	size_t run;
+	u8 ch;
+
+	if (!tr->synced) {
+		delim = memchr(p, 0x7e, len);
+		if (!delim)
+			return;
+		len -= delim - p;
+		p = delim;
+		tr->synced = true;
+	}
+
+	while (len) {
+		if (tr->escape && *p != 0x7e) {
+			ch = *p ^ 0x20;
+			xmm7360_trace_append(tr, &ch, 1);
+			tr->escape = false;
+			p++;
+			len--;
+			continue;
+		}
+
+		run = xmm7360_trace_span(p, len);
+		if (run) {
+			xmm7360_trace_append(tr, p, run);
+			p += run;
+			len -= run;
+			continue;
+		}
+
+		if (*p == 0x7d)
+			tr->escape = true;
+		else
+			xmm7360_trace_end_record(tr);
+		p++;
+		len--;
+	}
+}
+
+/* Feed every completed Rx TD through the deframer and hand it back */
+static void xmm7360_trace_drain(struct queue_pair *qp, struct xmm_trace_rx *tr)
 {
-	struct queue_pair *qp = file->private_data;
 	struct xmm_dev *xmm = qp->xmm;
 	struct td_ring *ring = &xmm->td_ring[qp->num * 2 + 1];
-	int idx, nread, ret;
-	ret = wait_event_interruptible(qp->wq,
-				       xmm7360_qp_has_data(qp) || xmm->error);
-	if (ret < 0)
-		return ret;
-	if (xmm->error)
-		return xmm->error;
+	int idx;
+	u8 rptr;
 
-	idx = ring->last_handled;
-	nread = ring->tds[idx].length;
-	if (nread > size)
-		nread = size;
-	ret = copy_to_user(buf, ring->pages[idx], nread);
-	nread -= ret;
+	if (!ring->depth)
+		return;
 
-	xmm7360_td_ring_read(xmm, qp->num * 2 + 1);
-	xmm7360_ding(xmm, DOORBELL_TD);
-	ring->last_handled = (idx + 1) & (ring->depth - 1);
+	while ((rptr = xmm7360_td_ring_rptr(xmm, qp->num * 2 + 1)) !=
+	       ring->last_handled) {
+		do {
+			idx = ring->last_handled;
+			xmm7360_trace_feed(tr, ring->pages[idx],
+					   ring->tds[idx].length);
+			xmm7360_td_ring_account(ring, ring->tds[idx].length);
+			xmm7360_td_ring_read(xmm, qp->num * 2 + 1);
+			ring->last_handled = (idx + 1) & (ring->depth - 1);
+		} while (ring->last_handled != rptr);
 
-	*offset += nread;
-	return nread;
+		xmm7360_td_ring_publish(xmm, qp->num * 2 + 1);
+		xmm7360_ding(xmm, DOORBELL_TD);
+	}
 }
 
-static unsigned int xmm7360_cdev_poll(struct file *file, poll_table *wait)
+/* One whole record per read; a record longer than the buffer is truncated */
+static ssize_t xmm7360_trace_read(struct queue_pair *qp,
+				  struct xmm_trace_rx *tr, char __user *buf,
+				  size_t size)
 {
-	struct queue_pair *qp = file->private_data;
-	unsigned int mask = 0;
+	struct xmm_dev *xmm = qp->xmm;
+	unsigned int copied;
+	int ret;
 
-	poll_wait(file, &qp->wq, wait);
+	if (mutex_lock_interruptible(&tr->lock))
+		return -ERESTARTSYS;
+
+	while (kfifo_is_empty(&tr->fifo)) {
+		xmm7360_trace_drain(qp, tr);
+		if (!kfifo_is_empty(&tr->fifo))
+			break;
+
+		mutex_unlock(&tr->lock);
+		ret = wait_event_interruptible(qp->wq,
+					       xmm7360_qp_has_data(qp) ||
+						       xmm->error);
+		if (ret < 0)
+			return ret;
+		if (xmm->error)
+			return xmm->error;
+		if (mutex_lock_interruptible(&tr->lock))
+			return -ERESTARTSYS;
+	}
 
-	if (qp->xmm->error)
-		return POLLHUP;
+	ret = kfifo_to_user(&tr->fifo, buf, size, &copied);
+	mutex_unlock(&tr->lock);
 
-	if (xmm7360_qp_has_data(qp))
-		mask |= POLLIN | POLLRDNORM;
+	return ret ? ret : copied;
+}
 
-	if (xmm7360_qp_can_write(qp))
-		mask |= POLLOUT | POLLWRNORM;
+static struct xmm_trace_rx *xmm7360_trace_get(struct queue_pair *qp)
+{
+	struct xmm_dev *xmm = qp->xmm;
+	struct xmm_trace_rx *tr;
 
-	return mask;
+	mutex_lock(&qp->lock);
+	tr = qp->trace;
+	if (tr)
+		goto out;
+
+	tr = kzalloc_node(sizeof(*tr), GFP_KERNEL, dev_to_node(xmm->dev));
+	if (!tr)
+		goto out;
+	tr->rec = kmalloc_node(TRACE_MAX_RECORD, GFP_KERNEL,
+			       dev_to_node(xmm->dev));
+	if (!tr->rec || kfifo_alloc(&tr->fifo, TRACE_FIFO_SIZE, GFP_KERNEL)) {
+		kfree(tr->rec);
+		kfree(tr);
+		tr = NULL;
+		goto out;
+	}
+	mutex_init(&tr->lock);
+	WRITE_ONCE(qp->trace, tr);
+out:
+	mutex_unlock(&qp->lock);
+	return tr;
 }
 
-static long xmm7360_cdev_ioctl(struct file *file, unsigned int cmd,
-			       unsigned long arg)
+static void xmm7360_trace_free(struct queue_pair *qp)
 {
-	struct queue_pair *qp = file->private_data;
+	struct xmm_trace_rx *tr = qp->trace;
 
-	u32 val;
+	if (!tr)
+		return;
+	qp->trace = NULL;
+	kfifo_free(&tr->fifo);
+	kfree(tr->rec);
+	kfree(tr);
+}
+
+static long xmm7360_trace_ioctl(struct queue_pair *qp, unsigned int cmd,
+				unsigned long arg)
+{
+	struct xmm7360_trace_filter filter;
+	struct xmm7360_trace_stats stats = {};
+	struct xmm_trace_rx *tr;
 
 	switch (cmd) {
-	case XMM7360_IOCTL_GET_PAGE_SIZE:
-		val = qp->xmm->td_ring[qp->num * 2].page_size;
-		if (copy_to_user((u32 *)arg, &val, sizeof(u32)))
+	case XMM7360_IOCTL_SET_TRACE_FILTER:
+		if (copy_from_user(&filter, (void __user *)arg, sizeof(filter)))
+			return -EFAULT;
+		if (filter.flags & ~XMM7360_TRACE_DEFRAME)
+			return -EINVAL;
+		if (!(filter.flags & XMM7360_TRACE_DEFRAME) && !qp->trace)
+			return 0;
+
+		tr = xmm7360_trace_get(qp);
+		if (!tr)
+			return -ENOMEM;
+		mutex_lock(&tr->lock);
+		/* Restart from the next delimiter on any mode change, so a
+		 * partial record is never delivered under the wrong filter.
+		 */
+		if (tr->enabled != !!(filter.flags & XMM7360_TRACE_DEFRAME)) {
+			tr->len = 0;
+			tr->synced = false;
+			tr->escape = false;
+			tr->oversize = false;
+			kfifo_reset(&tr->fifo);
+		}
+		tr->filter = filter;
+		WRITE_ONCE(tr->enabled,
+			   !!(filter.flags & XMM7360_TRACE_DEFRAME));
+		mutex_unlock(&tr->lock);
+		return 0;
+	case XMM7360_IOCTL_GET_TRACE_STATS:
+		tr = READ_ONCE(qp->trace);
+		if (tr) {
+			mutex_lock(&tr->lock);
+			stats = tr->stats;
+			mutex_unlock(&tr->lock);
+		}
+		if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
 			return -EFAULT;
 		return 0;
 	}
@@ -731,228 +1700,1569 @@ static long xmm7360_cdev_ioctl(struct file *file, unsigned int cmd,
 	return -ENOTTY;
 }
 
-static struct file_operations xmm7360_fops = {
-	.read = xmm7360_cdev_read,
-	.write = xmm7360_cdev_write,
-	.poll = xmm7360_cdev_poll,
-	.unlocked_ioctl = xmm7360_cdev_ioctl,
-	.open = xmm7360_cdev_open,
-	.release = xmm7360_cdev_release
-};
-
-static void xmm7360_mux_frame_init(struct xmm_net *xn, struct mux_frame *frame,
-				   int sequence)
+static struct xmm_client *xmm7360_rpc_find(struct xmm_rpc *rpc, u32 id)
 {
-	frame->sequence = xn->sequence;
-	frame->max_size = xn->xmm->td_ring[0].page_size;
-	frame->n_packets = 0;
-	frame->n_bytes = 0;
-	frame->last_tag_next = NULL;
-	frame->last_tag_length = NULL;
+	struct xmm_client *client;
+
+	list_for_each_entry(client, &rpc->clients, list)
+		if (client->id == id)
+			return client;
+	return NULL;
 }
 
-static int xmm7360_mux_frame_add_tag(struct mux_frame *frame, uint32_t tag,
-				     uint16_t extra, void *data, int data_len)
+static void xmm7360_rpc_deliver(struct xmm_client *client, const u8 *msg,
+				size_t len, u8 tid)
 {
-	int total_length;
-	if (frame->n_bytes == 0)
-		total_length = sizeof(struct mux_first_header) + data_len;
-	else
-		total_length = sizeof(struct mux_next_header) + data_len;
-
-	while (frame->n_bytes & 3)
-		frame->n_bytes++;
-
-	if (frame->n_bytes + total_length > frame->max_size)
-		return -1;
-
-	if (frame->last_tag_next)
-		*frame->last_tag_next = frame->n_bytes;
+	struct sk_buff *skb;
 
-	if (frame->n_bytes == 0) {
-		struct mux_first_header *hdr =
-			(struct mux_first_header *)frame->data;
-		memset(hdr, 0, sizeof(struct mux_first_header));
-		hdr->tag = htonl(tag);
-		hdr->sequence = frame->sequence;
-		hdr->length = total_length;
-		hdr->extra = extra;
-		frame->last_tag_length = &hdr->length;
-		frame->last_tag_next = &hdr->next;
-		frame->n_bytes += sizeof(struct mux_first_header);
-	} else {
-		struct mux_next_header *hdr =
-			(struct mux_next_header *)(&frame->data[frame->n_bytes]);
-		memset(hdr, 0, sizeof(struct mux_next_header));
-		hdr->tag = htonl(tag);
-		hdr->length = total_length;
-		hdr->extra = extra;
-		frame->last_tag_length = &hdr->length;
-		frame->last_tag_next = &hdr->next;
-		frame->n_bytes += sizeof(struct mux_next_header);
+	if (skb_queue_len(&client->rxq) >= RPC_RXQ_LEN) {
+		client->stats.dropped++;
+		return;
 	}
 
-	if (data_len) {
-		memcpy(&frame->data[frame->n_bytes], data, data_len);
-		frame->n_bytes += data_len;
+	skb = alloc_skb(len, GFP_ATOMIC);
+	if (!skb) {
+		client->stats.dropped++;
+		return;
+	}
+	skb_put_data(skb, msg, len);
+
+	/* Give the client back its own tid, in the tid word and in the
+	 * leading integer of a response that repeats it.
+	 */
+	if (tid) {
+		skb->data[RPC_TID_OFFSET + 3] = tid;
+		if (len >= RPC_HDR_LEN + 6 &&
+		    !memcmp(msg + RPC_HDR_LEN, "\x02\x04", 2) &&
+		    !memcmp(msg + RPC_HDR_LEN + 2, msg + RPC_TID_OFFSET, 4))
+			skb->data[RPC_HDR_LEN + 5] = tid;
 	}
 
-	return 0;
+	skb_queue_tail(&client->rxq, skb);
 }
 
-static int xmm7360_mux_frame_append_data(struct mux_frame *frame, void *data,
-					 int data_len)
+/* Unsolicited messages are only copied to the clients that want them;
+ * code is negative for anything else.
+ */
+static void xmm7360_rpc_broadcast(struct xmm_rpc *rpc, const u8 *msg,
+				  size_t len, int code)
 {
-	if (frame->n_bytes + data_len > frame->max_size)
-		return -1;
-
-	BUG_ON(!frame->last_tag_length);
-
-	memcpy(&frame->data[frame->n_bytes], data, data_len);
-	*frame->last_tag_length += data_len;
-	frame->n_bytes += data_len;
+	struct xmm_client *client;
 
-	return 0;
+	list_for_each_entry(client, &rpc->clients, list) {
+		if (code >= 0 && code < RPC_UNSOL_CODES &&
+		    !test_bit(code, client->unsol)) {
+			client->stats.filtered++;
+			continue;
+		}
+		xmm7360_rpc_deliver(client, msg, len, 0);
+	}
 }
 
-static int xmm7360_mux_frame_append_packet(struct mux_frame *frame,
-					   struct sk_buff *skb)
+/* Route one message from the modem to the client(s) it is meant for.
+ * Anything that can't be matched to a call goes to everyone, which is
+ * what a single client would have seen. Answers to a client that has
+ * closed are dropped.
+ */
+static void xmm7360_rpc_route_in(struct xmm_rpc *rpc, const u8 *msg,
+				 size_t len)
 {
-	int expected_adth_size =
-		sizeof(struct mux_next_header) + 4 +
-		(frame->n_packets + 1) * sizeof(struct mux_bounds);
+	struct xmm_client *client = NULL;
+	struct xmm_rpc_tid *t;
+	u32 tid_word, code, id;
+
+	spin_lock(&rpc->route_lock);
+
+	if (len < RPC_HDR_LEN) {
+		xmm7360_rpc_broadcast(rpc, msg, len, -1);
+		goto out;
+	}
+
+	tid_word = be32_to_cpup((__be32 *)(msg + RPC_TID_OFFSET));
+	code = be32_to_cpup((__be32 *)(msg + 12));
+	if ((tid_word & 0xffffff00) != RPC_TID_BASE) {
+		xmm7360_rpc_broadcast(rpc, msg, len, min_t(u32, code, INT_MAX));
+		goto out;
+	}
+
+	if (tid_word == RPC_TID_BASE) {
+		rpc->sync_stamp = jiffies;
+		if (!kfifo_get(&rpc->sync_waiters, &id)) {
+			xmm7360_rpc_broadcast(rpc, msg, len, -1);
+			goto out;
+		}
+		if (id)
+			client = xmm7360_rpc_find(rpc, id);
+		if (client)
+			xmm7360_rpc_deliver(client, msg, len, 0);
+		goto out;
+	}
+
+	t = &rpc->tids[tid_word & 0xff];
+	if (t->client) {
+		client = xmm7360_rpc_find(rpc, t->client);
+		if (client)
+			xmm7360_rpc_deliver(client, msg, len, t->tid);
+	} else {
+		xmm7360_rpc_broadcast(rpc, msg, len, -1);
+	}
+
+	/* Codes from 2000 up complete an asynchronous call */
+	if (code >= 2000)
+		t->client = 0;
+out:
+	spin_unlock(&rpc->route_lock);
+}
+
+/* Note who is waiting for the answer to a call, renumbering asynchronous
+ * tids so that answers to different clients can be told apart.
+ */
+static void xmm7360_rpc_route_out(struct xmm_rpc *rpc,
+				  struct xmm_client *client, u8 *msg,
+				  size_t len)
+{
+	u32 tid_word;
+	u8 tid;
+
+	if (len < RPC_HDR_LEN)
+		return;
+
+	tid_word = be32_to_cpup((__be32 *)(msg + RPC_TID_OFFSET));
+	if ((tid_word & 0xffffff00) != RPC_TID_BASE)
+		return;
+
+	if (tid_word == RPC_TID_BASE) {
+		if (kfifo_is_empty(&rpc->sync_waiters)) {
+			rpc->sync_stamp = jiffies;
+		} else if (time_after(jiffies,
+				      rpc->sync_stamp + RPC_SYNC_TIMEOUT)) {
+			dev_warn_ratelimited(client->qp->xmm->dev,
+					     "giving up on %u unanswered RPC calls\n",
+					     kfifo_len(&rpc->sync_waiters));
+			kfifo_reset(&rpc->sync_waiters);
+			rpc->sync_stamp = jiffies;
+		}
+		if (!kfifo_put(&rpc->sync_waiters, client->id))
+			dev_warn_ratelimited(client->qp->xmm->dev,
+					     "too many RPC calls in flight\n");
+		return;
+	}
+
+	tid = rpc->next_tid;
+	rpc->next_tid = tid == 0xff ? 1 : tid + 1;
+	rpc->tids[tid].client = client->id;
+	rpc->tids[tid].tid = tid_word & 0xff;
+
+	msg[RPC_TID_OFFSET + 3] = tid;
+	if (len >= RPC_HDR_LEN + 6 &&
+	    !memcmp(msg + RPC_HDR_LEN, "\x02\x04", 2) &&
+	    !memcmp(msg + RPC_HDR_LEN + 2, msg + RPC_TID_OFFSET, 3) &&
+	    msg[RPC_HDR_LEN + 5] == (tid_word & 0xff))
+		msg[RPC_HDR_LEN + 5] = tid;
+}
+
+/* The RPC queue pair is drained from the IRQ, as there is no single
+ * reader to leave it to.
+ */
+static void xmm7360_rpc_poll_qp(struct queue_pair *qp)
+{
+	struct xmm_dev *xmm = qp->xmm;
+	struct td_ring *ring = &xmm->td_ring[qp->num * 2 + 1];
+	int idx;
+	u8 rptr;
+
+	if (!ring->depth)
+		return;
+
+	while ((rptr = xmm7360_td_ring_rptr(xmm, qp->num * 2 + 1)) !=
+	       ring->last_handled) {
+		do {
+			idx = ring->last_handled;
+			xmm7360_rpc_route_in(&xmm->rpc, ring->pages[idx],
+					     ring->tds[idx].length);
+			xmm7360_td_ring_account(ring, ring->tds[idx].length);
+			xmm7360_td_ring_read(xmm, qp->num * 2 + 1);
+			ring->last_handled = (idx + 1) & (ring->depth - 1);
+		} while (ring->last_handled != rptr);
+
+		xmm7360_td_ring_publish(xmm, qp->num * 2 + 1);
+		xmm7360_ding(xmm, DOORBELL_TD);
+	}
+}
+
+static void xmm7360_rpc_init(struct xmm_rpc *rpc)
+{
+	mutex_init(&rpc->lock);
+	spin_lock_init(&rpc->route_lock);
+	INIT_LIST_HEAD(&rpc->clients);
+	INIT_KFIFO(rpc->sync_waiters);
+	rpc->next_client = 1;
+	rpc->next_tid = 1;
+}
+
+/* The queue pair stays open while any client has the cdev open */
+static int xmm7360_rpc_attach(struct xmm_client *client)
+{
+	struct queue_pair *qp = client->qp;
+	struct xmm_rpc *rpc = &qp->xmm->rpc;
+	int ret = 0;
+
+	mutex_lock(&rpc->lock);
+
+	spin_lock_irq(&rpc->route_lock);
+	client->id = rpc->next_client++;
+	if (!rpc->next_client)
+		rpc->next_client = 1;
+	list_add_tail(&client->list, &rpc->clients);
+	spin_unlock_irq(&rpc->route_lock);
+
+	if (!rpc->users) {
+		spin_lock_irq(&rpc->route_lock);
+		kfifo_reset(&rpc->sync_waiters);
+		memset(rpc->tids, 0, sizeof(rpc->tids));
+		spin_unlock_irq(&rpc->route_lock);
+
+		ret = xmm7360_qp_start(qp);
+	}
+
+	if (ret) {
+		spin_lock_irq(&rpc->route_lock);
+		list_del(&client->list);
+		spin_unlock_irq(&rpc->route_lock);
+	} else {
+		rpc->users++;
+	}
+
+	mutex_unlock(&rpc->lock);
+	return ret;
+}
+
+static int xmm7360_rpc_detach(struct xmm_client *client)
+{
+	struct xmm_rpc *rpc = &client->qp->xmm->rpc;
+	unsigned int i, n;
+	int ret = 0;
+	u32 id;
+
+	mutex_lock(&rpc->lock);
+
+	spin_lock_irq(&rpc->route_lock);
+	list_del(&client->list);
+	/* The modem still answers this client's calls in turn, so keep
+	 * their places in the queue but make sure nobody gets the answers.
+	 */
+	n = kfifo_len(&rpc->sync_waiters);
+	for (i = 0; i < n; i++) {
+		if (!kfifo_get(&rpc->sync_waiters, &id))
+			break;
+		kfifo_put(&rpc->sync_waiters, id == client->id ? 0 : id);
+	}
+	spin_unlock_irq(&rpc->route_lock);
+
+	if (!--rpc->users)
+		ret = xmm7360_qp_stop(client->qp);
+
+	mutex_unlock(&rpc->lock);
+
+	skb_queue_purge(&client->rxq);
+	return ret;
+}
+
+static ssize_t xmm7360_rpc_write(struct xmm_client *client,
+				 const char __user *buf, size_t size)
+{
+	struct queue_pair *qp = client->qp;
+	struct xmm_dev *xmm = qp->xmm;
+	struct xmm_rpc *rpc = &xmm->rpc;
+	int page_size = xmm->td_ring[qp->num * 2].page_size;
+	unsigned long flags;
+	ssize_t ret;
+
+	if (size > page_size)
+		size = page_size;
+
+	mutex_lock(&rpc->lock);
+
+	if (copy_from_user(qp->user_buf, buf, size)) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	/* The answer may come back before qp_write returns */
+	spin_lock_irqsave(&rpc->route_lock, flags);
+	if (xmm->error) {
+		ret = xmm->error;
+	} else if (!xmm7360_qp_can_write(qp)) {
+		ret = 0;
+	} else {
+		xmm7360_rpc_route_out(rpc, client, qp->user_buf, size);
+		ret = xmm7360_qp_write(qp, qp->user_buf, size);
+	}
+	spin_unlock_irqrestore(&rpc->route_lock, flags);
+out:
+	mutex_unlock(&rpc->lock);
+	return ret;
+}
+
+static ssize_t xmm7360_rpc_read(struct xmm_client *client, char __user *buf,
+				size_t size)
+{
+	struct queue_pair *qp = client->qp;
+	struct xmm_dev *xmm = qp->xmm;
+	struct sk_buff *skb;
+	size_t len;
 	int ret;
-	uint8_t pad[16];
 
-	if (frame->n_packets >= MUX_MAX_PACKETS)
-		return -1;
+	do {
+		ret = wait_event_interruptible(qp->wq,
+					       !skb_queue_empty(&client->rxq) ||
+						       xmm->error);
+		if (ret < 0)
+			return ret;
+		if (xmm->error)
+			return xmm->error;
+		skb = skb_dequeue(&client->rxq);
+	} while (!skb);
+
+	len = min_t(size_t, size, skb->len);
+	ret = copy_to_user(buf, skb->data, len) ? -EFAULT : len;
+	consume_skb(skb);
+	return ret;
+}
 
-	if (frame->n_bytes + skb->len + 16 + expected_adth_size >
-	    frame->max_size)
-		return -1;
+static long xmm7360_rpc_ioctl(struct xmm_client *client, unsigned int cmd,
+			      unsigned long arg)
+{
+	struct xmm_rpc *rpc = &client->qp->xmm->rpc;
+	struct xmm7360_rpc_unsol_filter filter;
+	struct xmm7360_rpc_stats stats;
 
-	BUG_ON(!frame->last_tag_length);
+	switch (cmd) {
+	case XMM7360_IOCTL_RPC_UNSOL:
+		spin_lock_irq(&rpc->route_lock);
+		if (arg)
+			bitmap_fill(client->unsol, RPC_UNSOL_CODES);
+		else
+			bitmap_zero(client->unsol, RPC_UNSOL_CODES);
+		spin_unlock_irq(&rpc->route_lock);
+		return 0;
+	case XMM7360_IOCTL_RPC_UNSOL_FILTER:
+		if (copy_from_user(&filter, (void __user *)arg, sizeof(filter)))
+			return -EFAULT;
+		spin_lock_irq(&rpc->route_lock);
+		bitmap_from_arr32(client->unsol, filter.codes, RPC_UNSOL_CODES);
+		spin_unlock_irq(&rpc->route_lock);
+		return 0;
+	case XMM7360_IOCTL_RPC_GET_STATS:
+		spin_lock_irq(&rpc->route_lock);
+		stats = client->stats;
+		spin_unlock_irq(&rpc->route_lock);
+		if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+			return -EFAULT;
+		return 0;
+	}
 
-	frame->bounds[frame->n_packets].offset = frame->n_bytes;
-	frame->bounds[frame->n_packets].length = skb->len + 16;
-	frame->n_packets++;
+	return -ENOTTY;
+}
 
-	memset(pad, 0, sizeof(pad));
-	ret = xmm7360_mux_frame_append_data(frame, pad, 16);
+int xmm7360_cdev_open(struct inode *inode, struct file *file)
+{
+	struct queue_pair *qp =
+		container_of(inode->i_cdev, struct queue_pair, cdev);
+	struct xmm_client *client;
+	int ret;
+
+	client = kzalloc(sizeof(*client), GFP_KERNEL);
+	if (!client)
+		return -ENOMEM;
+	client->qp = qp;
+	bitmap_fill(client->unsol, RPC_UNSOL_CODES);
+	skb_queue_head_init(&client->rxq);
+	file->private_data = client;
+
+	ret = xmm7360_pm_get(qp->xmm);
+	if (ret)
+		goto err_free;
+	if (qp->num == 1)
+		ret = xmm7360_rpc_attach(client);
+	else
+		ret = xmm7360_qp_start(qp);
 	if (ret)
+		goto err_put;
+	return 0;
+
+err_put:
+	xmm7360_pm_put(qp->xmm);
+err_free:
+	kfree(client);
+	return ret;
+}
+
+int xmm7360_cdev_release(struct inode *inode, struct file *file)
+{
+	struct xmm_client *client = file->private_data;
+	struct queue_pair *qp = client->qp;
+	int ret;
+
+	if (qp->num == 1)
+		ret = xmm7360_rpc_detach(client);
+	else
+		ret = xmm7360_qp_stop(qp);
+	xmm7360_trace_free(qp);
+	xmm7360_pm_put(qp->xmm);
+	kfree(client);
+	return ret;
+}
+
+ssize_t xmm7360_cdev_write(struct file *file, const char __user *buf,
+			   size_t size, loff_t *offset)
+{
+	struct xmm_client *client = file->private_data;
+	struct queue_pair *qp = client->qp;
+	int ret;
+
+	if (qp->num == 1) {
+		ret = xmm7360_rpc_write(client, buf, size);
+	} else {
+		/* Not while the rings are being reset */
+		mutex_lock(&qp->lock);
+		ret = xmm7360_qp_write_user(qp, buf, size);
+		mutex_unlock(&qp->lock);
+	}
+	if (ret < 0)
 		return ret;
 
-	ret = xmm7360_mux_frame_append_data(frame, skb->data, skb->len);
+	*offset += ret;
+	return size;
+}
+
+ssize_t xmm7360_cdev_read(struct file *file, char __user *buf, size_t size,
+			  loff_t *offset)
+{
+	struct xmm_client *client = file->private_data;
+	struct queue_pair *qp = client->qp;
+	struct xmm_dev *xmm = qp->xmm;
+	struct td_ring *ring = &xmm->td_ring[qp->num * 2 + 1];
+	struct xmm_trace_rx *tr = READ_ONCE(qp->trace);
+	int idx, nread, ret;
+
+	if (qp->num == 1) {
+		ret = xmm7360_rpc_read(client, buf, size);
+		if (ret > 0)
+			*offset += ret;
+		return ret;
+	}
+
+	if (tr && READ_ONCE(tr->enabled))
+		return xmm7360_trace_read(qp, tr, buf, size);
+
+	for (;;) {
+		ret = wait_event_interruptible(qp->wq,
+					       xmm7360_qp_has_data(qp) ||
+						       xmm->error);
+		if (ret < 0)
+			return ret;
+		if (xmm->error)
+			return xmm->error;
+
+		/* A reset may rewind the ring until this is dropped */
+		mutex_lock(&qp->lock);
+		if (xmm7360_qp_has_data(qp))
+			break;
+		mutex_unlock(&qp->lock);
+	}
+
+	/* Pairs with the modem's update of s_rptr seen by has_data */
+	dma_rmb();
+	idx = ring->last_handled;
+	nread = ring->tds[idx].length;
+	xmm7360_td_ring_account(ring, nread);
+	if (nread > size)
+		nread = size;
+	ret = copy_to_user(buf, ring->pages[idx], nread);
+	nread -= ret;
+
+	xmm7360_td_ring_read(xmm, qp->num * 2 + 1);
+	xmm7360_td_ring_publish(xmm, qp->num * 2 + 1);
+	xmm7360_ding(xmm, DOORBELL_TD);
+	ring->last_handled = (idx + 1) & (ring->depth - 1);
+	mutex_unlock(&qp->lock);
+
+	*offset += nread;
+	return nread;
+}
+
+static unsigned int xmm7360_cdev_poll(struct file *file, poll_table *wait)
+{
+	struct xmm_client *client = file->private_data;
+	struct queue_pair *qp = client->qp;
+	struct xmm_trace_rx *tr = READ_ONCE(qp->trace);
+	unsigned int mask = 0;
+
+	poll_wait(file, &qp->wq, wait);
+
+	if (qp->xmm->error)
+		return POLLHUP;
+
+	if (qp->num == 1) {
+		if (!skb_queue_empty(&client->rxq))
+			mask |= POLLIN | POLLRDNORM;
+	} else if (tr && READ_ONCE(tr->enabled)) {
+		/* Only records that pass the filter make the file readable */
+		mutex_lock(&tr->lock);
+		xmm7360_trace_drain(qp, tr);
+		if (!kfifo_is_empty(&tr->fifo))
+			mask |= POLLIN | POLLRDNORM;
+		mutex_unlock(&tr->lock);
+	} else if (xmm7360_qp_has_data(qp))
+		mask |= POLLIN | POLLRDNORM;
+
+	if (xmm7360_qp_can_write(qp))
+		mask |= POLLOUT | POLLWRNORM;
+
+	return mask;
+}
+
+/* Flush or restart a cdev's queue pair. Both keep the IRQ handler and
+ * plain reads and writes, which take qp->lock, off the rings; hold off
+ * the RPC and trace paths here too. The mux queue pair has no cdev; the
+ * net device quiesces itself before resetting it.
+ */
+static int xmm7360_cdev_qp_reset(struct queue_pair *qp, bool restart)
+{
+	struct xmm_rpc *rpc = &qp->xmm->rpc;
+	struct xmm_trace_rx *tr = READ_ONCE(qp->trace);
+	int ret;
+
+	if (qp->num == 1) {
+		/* Writers, and clients joining or leaving */
+		mutex_lock(&rpc->lock);
+		ret = restart ? xmm7360_qp_restart(qp) : xmm7360_qp_reset(qp);
+		mutex_unlock(&rpc->lock);
+		return ret;
+	}
+
+	if (tr) {
+		/* Readers and pollers draining the Rx ring */
+		mutex_lock(&tr->lock);
+		ret = restart ? xmm7360_qp_restart(qp) : xmm7360_qp_reset(qp);
+		mutex_unlock(&tr->lock);
+		return ret;
+	}
+
+	return restart ? xmm7360_qp_restart(qp) : xmm7360_qp_reset(qp);
+}
+
+static long xmm7360_cdev_ioctl(struct file *file, unsigned int cmd,
+			       unsigned long arg)
+{
+	struct xmm_client *client = file->private_data;
+	struct queue_pair *qp = client->qp;
+
+	u32 val;
+
+	switch (cmd) {
+	case XMM7360_IOCTL_GET_PAGE_SIZE:
+		val = qp->xmm->td_ring[qp->num * 2].page_size;
+		if (copy_to_user((u32 *)arg, &val, sizeof(u32)))
+			return -EFAULT;
+		return 0;
+	case XMM7360_IOCTL_RESET_QP:
+		return xmm7360_cdev_qp_reset(qp, false);
+	case XMM7360_IOCTL_SET_TRACE_FILTER:
+	case XMM7360_IOCTL_GET_TRACE_STATS:
+		if (qp->num != 3)
+			return -ENOTTY;
+		return xmm7360_trace_ioctl(qp, cmd, arg);
+	case XMM7360_IOCTL_RPC_UNSOL:
+	case XMM7360_IOCTL_RPC_UNSOL_FILTER:
+	case XMM7360_IOCTL_RPC_GET_STATS:
+		if (qp->num != 1)
+			return -ENOTTY;
+		return xmm7360_rpc_ioctl(client, cmd, arg);
+	}
+
+	return -ENOTTY;
+}
+
+static struct file_operations xmm7360_fops = {
+	.read = xmm7360_cdev_read,
+	.write = xmm7360_cdev_write,
+	.poll = xmm7360_cdev_poll,
+	.unlocked_ioctl = xmm7360_cdev_ioctl,
+	.open = xmm7360_cdev_open,
+	.release = xmm7360_cdev_release
+};
+
+static void xmm7360_mux_frame_init(struct xmm_net *xn, struct mux_frame *frame,
+				   int sequence)
+{
+	frame->sequence = xn->sequence;
+	frame->max_size = xn->xmm->td_ring[0].page_size;
+	frame->n_packets = 0;
+	frame->n_bytes = 0;
+	frame->last_tag_next = NULL;
+	frame->last_tag_length = NULL;
+}
+
+static int xmm7360_mux_frame_add_tag(struct mux_frame *frame, uint32_t tag,
+				     uint16_t extra, void *data, int data_len)
+{
+	int total_length;
+	if (frame->n_bytes == 0)
+		total_length = sizeof(struct mux_first_header) + data_len;
+	else
+		total_length = sizeof(struct mux_next_header) + data_len;
+
+	while (frame->n_bytes & 3)
+		frame->n_bytes++;
+
+	if (frame->n_bytes + total_length > frame->max_size)
+		return -1;
+
+	if (frame->last_tag_next)
+		*frame->last_tag_next = frame->n_bytes;
+
+	if (frame->n_bytes == 0) {
+		struct mux_first_header *hdr =
+			(struct mux_first_header *)frame->data;
+		memset(hdr, 0, sizeof(struct mux_first_header));
+		hdr->tag = htonl(tag);
+		hdr->sequence = frame->sequence;
+		hdr->length = total_length;
+		hdr->extra = extra;
+		frame->last_tag_length = &hdr->length;
+		frame->last_tag_next = &hdr->next;
+		frame->n_bytes += sizeof(struct mux_first_header);
+	} else {
+		struct mux_next_header *hdr =
+			(struct mux_next_header *)(&frame->data[frame->n_bytes]);
+		memset(hdr, 0, sizeof(struct mux_next_header));
+		hdr->tag = htonl(tag);
+		hdr->length = total_length;
+		hdr->extra = extra;
+		frame->last_tag_length = &hdr->length;
+		frame->last_tag_next = &hdr->next;
+		frame->n_bytes += sizeof(struct mux_next_header);
+	}
+
+	if (data_len) {
+		memcpy(&frame->data[frame->n_bytes], data, data_len);
+		frame->n_bytes += data_len;
+	}
+
+	return 0;
+}
+
+static int xmm7360_mux_frame_append_data(struct mux_frame *frame, void *data,
+					 int data_len)
+{
+	if (frame->n_bytes + data_len > frame->max_size)
+		return -1;
+
+	BUG_ON(!frame->last_tag_length);
+
+	memcpy(&frame->data[frame->n_bytes], data, data_len);
+	*frame->last_tag_length += data_len;
+	frame->n_bytes += data_len;
+
+	return 0;
+}
+
+static int xmm7360_mux_frame_append_packet(struct mux_frame *frame,
+					   struct sk_buff *skb)
+{
+	int expected_adth_size =
+		3 + sizeof(struct mux_next_header) + 4 +
+		(frame->n_packets + 1) * sizeof(struct mux_bounds);
+	int ret;
+	uint8_t pad[16];
+
+	if (frame->n_packets >= MUX_MAX_PACKETS)
+		return -1;
+
+	if (frame->n_bytes + skb->len + 16 + expected_adth_size >
+	    frame->max_size)
+		return -1;
+
+	BUG_ON(!frame->last_tag_length);
+
+	frame->bounds[frame->n_packets].offset = frame->n_bytes;
+	frame->bounds[frame->n_packets].length = skb->len + 16;
+	frame->n_packets++;
+
+	memset(pad, 0, sizeof(pad));
+	ret = xmm7360_mux_frame_append_data(frame, pad, 16);
+	if (ret)
+		return ret;
+
+	ret = xmm7360_mux_frame_append_data(frame, skb->data, skb->len);
+	return ret;
+}
+
+static int xmm7360_mux_frame_push(struct xmm_dev *xmm, struct mux_frame *frame)
+{
+	struct mux_first_header *hdr = (void *)&frame->data[0];
+	int ret;
+	hdr->length = frame->n_bytes;
+
+	ret = xmm7360_qp_write(xmm->net->qp, frame->data, frame->n_bytes);
+	if (ret < 0)
+		return ret;
+	return 0;
+}
+
+static int xmm7360_mux_control(struct xmm_net *xn, u32 arg1, u32 arg2, u32 arg3,
+			       u32 arg4)
+{
+	struct mux_frame *frame = &xn->frame;
+	int ret;
+	uint32_t cmdh_args[] = { arg1, arg2, arg3, arg4 };
+	unsigned long flags;
+
+	spin_lock_irqsave(&xn->lock, flags);
+
+	xmm7360_mux_frame_init(xn, frame, 0);
+	xmm7360_mux_frame_add_tag(frame, 'ACBH', 0, NULL, 0);
+	xmm7360_mux_frame_add_tag(frame, 'CMDH', xn->channel, cmdh_args,
+				  sizeof(cmdh_args));
+	ret = xmm7360_mux_frame_push(xn->xmm, frame);
+
+	spin_unlock_irqrestore(&xn->lock, flags);
+
+	return ret;
+}
+
+static void xmm7360_net_uninit(struct net_device *dev)
+{
+}
+
+static int xmm7360_net_open(struct net_device *dev)
+{
+	struct xmm_net *xn = netdev_priv(dev);
+	struct sk_buff *skb;
+	int ret;
+
+	ret = xmm7360_pm_get(xn->xmm);
+	if (ret)
+		return ret;
+
+	xn->queued_packets = xn->queued_bytes = 0;
+	while ((skb = skb_dequeue(&xn->queue)))
+		kfree_skb(skb);
+	codel_params_init(&xn->cparams);
+	codel_vars_init(&xn->cvars);
+	codel_stats_init(&xn->cstats);
+	netif_start_queue(dev);
+	ret = xmm7360_mux_control(xn, 1, 0, 0, 0);
+	if (ret) {
+		netif_stop_queue(dev);
+		xmm7360_pm_put(xn->xmm);
+	}
+	return ret;
+}
+
+static int xmm7360_net_close(struct net_device *dev)
+{
+	struct xmm_net *xn = netdev_priv(dev);
+
+	netif_stop_queue(dev);
+	xmm7360_pm_put(xn->xmm);
+	return 0;
+}
+
+static int xmm7360_net_must_flush(struct xmm_net *xn, int new_packet_bytes)
+{
+	int frame_size;
+	if (xn->queued_packets >= MUX_MAX_PACKETS)
+		return 1;
+
+	frame_size = xn->queued_bytes + new_packet_bytes +
+		     sizeof(struct mux_bounds) * xn->queued_packets +
+		     MUX_FRAME_OVERHEAD;
+
+	if (READ_ONCE(qlth_interval_us))
+		frame_size += MUX_QLTH_SIZE;
+
+	return frame_size > xn->frame.max_size;
+}
+
+/* Whether @skb still fits in @frame, leaving room for the ADTH table and
+ * any QLTH tag that will follow.
+ */
+static int xmm7360_net_frame_fits(struct mux_frame *frame,
+				  struct sk_buff *skb)
+{
+	int size = frame->n_bytes + 16 + skb->len + 3 +
+		   sizeof(struct mux_next_header) + 4 +
+		   (frame->n_packets + 1) * sizeof(struct mux_bounds);
+
+	if (READ_ONCE(qlth_interval_us))
+		size += MUX_QLTH_SIZE;
+
+	return frame->n_packets < MUX_MAX_PACKETS && size <= frame->max_size;
+}
+
+static u32 xmm7360_net_qdisc_backlog(struct net_device *dev)
+{
+	struct netdev_queue *txq = netdev_get_tx_queue(dev, 0);
+	struct Qdisc *q;
+	u32 qlen, backlog = 0;
+
+	rcu_read_lock();
+	q = rcu_dereference(txq->qdisc);
+	if (q)
+		qdisc_qstats_qlen_backlog(q, &qlen, &backlog);
+	rcu_read_unlock();
+
+	return backlog;
+}
+
+static void xmm7360_net_burst_begin(struct xmm_net *xn, ktime_t now)
+{
+	if (ktime_ms_delta(now, xn->last_tx) < QLTH_AB_IDLE_MS)
+		return;
+
+	xn->burst_start = now;
+	xn->burst_bytes = 0;
+	xn->burst_ramping = true;
+	xn->burst_arm = !xn->burst_arm;
+}
+
+static void xmm7360_net_burst_account(struct xmm_net *xn, ktime_t now,
+				      int bytes)
+{
+	xn->last_tx = now;
+	if (!xn->burst_ramping)
+		return;
+
+	xn->burst_bytes += bytes;
+	if (xn->burst_bytes < QLTH_AB_RAMP_BYTES)
+		return;
+
+	xn->burst_ramping = false;
+	xn->stats.qlth_ab_bursts[xn->burst_arm]++;
+	xn->stats.qlth_ab_ramp_us[xn->burst_arm] +=
+		ktime_us_delta(now, xn->burst_start);
+}
+
+/* Tell the modem how much uplink data is waiting, so it can ask the
+ * network for a larger grant: this frame plus whatever sits in the qdisc.
+ */
+static void xmm7360_net_add_qlth(struct xmm_net *xn, struct mux_frame *frame,
+				 ktime_t now)
+{
+	unsigned int interval = READ_ONCE(qlth_interval_us);
+	struct mux_queue_level ql;
+
+	if (!interval)
+		return;
+	if (qlth_ab && !xn->burst_arm)
+		return;
+	if (ktime_us_delta(now, xn->qlth_last) < interval)
+		return;
+
+	memset(&ql, 0, sizeof(ql));
+	ql.bytes = frame->n_bytes + xn->queued_bytes +
+		   xmm7360_net_qdisc_backlog(xn->xmm->netdev);
+
+	if (xmm7360_mux_frame_add_tag(frame, 'QLTH', xn->channel, &ql,
+				      sizeof(ql)))
+		return;
+
+	xn->qlth_last = now;
+	xn->stats.qlth_tags++;
+}
+
+/* A pure TCP ACK sitting in the coalescing queue, with pointers into its
+ * headers. Only NOP, EOL, timestamp and SACK options are understood.
+ */
+struct xmm_ack_info {
+	const void *saddr, *daddr;
+	int alen;
+	__be16 sport, dport;
+	u8 flags, ecn;
+	u32 ack_seq;
+	bool sack, has_ts;
+	u32 tsval, tsecr;
+};
+
+#define ACK_FILTER_FLOWS 8
+
+static bool xmm7360_ack_parse_opts(const u8 *ptr, int len,
+				   struct xmm_ack_info *ai)
+{
+	__be32 val;
+	u8 kind, size;
+
+	while (len > 0) {
+		kind = ptr[0];
+		if (kind == TCPOPT_EOL)
+			break;
+		if (kind == TCPOPT_NOP) {
+			ptr++;
+			len--;
+			continue;
+		}
+		if (len < 2)
+			return false;
+		size = ptr[1];
+		if (size < 2 || size > len)
+			return false;
+
+		switch (kind) {
+		case TCPOPT_TIMESTAMP:
+			if (size != TCPOLEN_TIMESTAMP)
+				return false;
+			ai->has_ts = true;
+			memcpy(&val, ptr + 2, sizeof(val));
+			ai->tsval = ntohl(val);
+			memcpy(&val, ptr + 6, sizeof(val));
+			ai->tsecr = ntohl(val);
+			break;
+		case TCPOPT_SACK:
+			ai->sack = true;
+			break;
+		default:
+			return false;
+		}
+
+		ptr += size;
+		len -= size;
+	}
+
+	return true;
+}
+
+static bool xmm7360_ack_parse(struct sk_buff *skb, struct xmm_ack_info *ai)
+{
+	const struct tcphdr *th;
+	int ip_len, tcp_len;
+
+	memset(ai, 0, sizeof(*ai));
+
+	if (skb_headlen(skb) < sizeof(struct iphdr))
+		return false;
+
+	switch (skb->data[0] >> 4) {
+	case 4: {
+		const struct iphdr *iph = (void *)skb->data;
+
+		if (iph->protocol != IPPROTO_TCP || ip_is_fragment(iph))
+			return false;
+		ip_len = iph->ihl * 4;
+		ai->saddr = &iph->saddr;
+		ai->daddr = &iph->daddr;
+		ai->alen = sizeof(iph->saddr);
+		ai->ecn = iph->tos & INET_ECN_MASK;
+		break;
+	}
+	case 6: {
+		const struct ipv6hdr *ip6h = (void *)skb->data;
+
+		if (skb_headlen(skb) < sizeof(*ip6h) ||
+		    ip6h->nexthdr != IPPROTO_TCP)
+			return false;
+		ip_len = sizeof(*ip6h);
+		ai->saddr = &ip6h->saddr;
+		ai->daddr = &ip6h->daddr;
+		ai->alen = sizeof(ip6h->saddr);
+		ai->ecn = ipv6_get_dsfield(ip6h) & INET_ECN_MASK;
+		break;
+	}
+	default:
+		return false;
+	}
+
+	if (skb_headlen(skb) < ip_len + sizeof(struct tcphdr))
+		return false;
+	th = (void *)(skb->data + ip_len);
+	tcp_len = th->doff * 4;
+	if (tcp_len < sizeof(struct tcphdr) ||
+	    skb_headlen(skb) < ip_len + tcp_len)
+		return false;
+
+	/* Anything carrying payload or control flags is not a pure ACK */
+	if (skb->len != ip_len + tcp_len)
+		return false;
+	ai->flags = tcp_flag_byte(th);
+	if ((ai->flags & ~(TCPHDR_ECE | TCPHDR_CWR)) != TCPHDR_ACK)
+		return false;
+
+	ai->sport = th->source;
+	ai->dport = th->dest;
+	ai->ack_seq = ntohl(th->ack_seq);
+
+	return xmm7360_ack_parse_opts((const u8 *)(th + 1),
+				      tcp_len - sizeof(struct tcphdr), ai);
+}
+
+static bool xmm7360_ack_same_flow(const struct xmm_ack_info *a,
+				  const struct xmm_ack_info *b)
+{
+	return a->alen == b->alen && a->sport == b->sport &&
+	       a->dport == b->dport && !memcmp(a->saddr, b->saddr, a->alen) &&
+	       !memcmp(a->daddr, b->daddr, a->alen);
+}
+
+/* Whether dropping @older loses nothing the sender needs once @newer has
+ * been delivered. Duplicate ACKs, SACK blocks, CE marks and ECE/CWR
+ * changes all carry information, so those ACKs are kept.
+ */
+static bool xmm7360_ack_supersedes(const struct xmm_ack_info *newer,
+				   const struct xmm_ack_info *older)
+{
+	if (newer->flags != older->flags)
+		return false;
+	if (!after(newer->ack_seq, older->ack_seq))
+		return false;
+	if (older->sack || older->ecn == INET_ECN_CE)
+		return false;
+	if (newer->has_ts != older->has_ts)
+		return false;
+	if (newer->has_ts && (before(newer->tsval, older->tsval) ||
+			      before(newer->tsecr, older->tsecr)))
+		return false;
+	return true;
+}
+
+/* Walk the queue from newest to oldest, remembering the most recent pure
+ * ACK of each flow, and drop older ACKs that it makes redundant.
+ */
+static void xmm7360_net_ack_filter(struct xmm_net *xn)
+{
+	struct xmm_ack_info flows[ACK_FILTER_FLOWS], ai;
+	struct sk_buff *skb, *tmp;
+	int n_flows = 0, i;
+
+	skb_queue_reverse_walk_safe(&xn->queue, skb, tmp) {
+		if (!xmm7360_ack_parse(skb, &ai))
+			continue;
+		if (!XMM7360_SKB_CB(skb)->ack_counted) {
+			XMM7360_SKB_CB(skb)->ack_counted = true;
+			xn->stats.ack_filter_acks++;
+		}
+
+		for (i = 0; i < n_flows; i++)
+			if (xmm7360_ack_same_flow(&flows[i], &ai))
+				break;
+
+		if (i == n_flows) {
+			if (n_flows < ACK_FILTER_FLOWS)
+				flows[n_flows++] = ai;
+			continue;
+		}
+
+		if (!xmm7360_ack_supersedes(&flows[i], &ai)) {
+			flows[i] = ai;
+			continue;
+		}
+
+		skb_unlink(skb, &xn->queue);
+		xn->queued_packets--;
+		xn->queued_bytes -= 16 + skb->len;
+		xn->stats.ack_filter_dropped++;
+		dev_kfree_skb_any(skb);
+	}
+}
+
+static u32 xmm7360_codel_skb_len(const struct sk_buff *skb)
+{
+	return 16 + skb->len;
+}
+
+static codel_time_t xmm7360_codel_skb_time(const struct sk_buff *skb)
+{
+	return ktime_to_ns(XMM7360_SKB_CB(skb)->enqueued) >> CODEL_SHIFT;
+}
+
+static void xmm7360_codel_drop(struct sk_buff *skb, void *ctx)
+{
+	struct xmm_net *xn = ctx;
+
+	xn->xmm->netdev->stats.tx_dropped++;
+	dev_kfree_skb_any(skb);
+}
+
+static struct sk_buff *xmm7360_codel_dequeue(struct codel_vars *vars,
+					     void *ctx)
+{
+	struct xmm_net *xn = ctx;
+	struct sk_buff *skb = skb_dequeue(&xn->queue);
+
+	if (skb) {
+		xn->queued_packets--;
+		xn->queued_bytes -= 16 + skb->len;
+	}
+	return skb;
+}
+
+static void xmm7360_net_record_sojourn(struct xmm_net *xn,
+				       struct sk_buff *skb, ktime_t now)
+{
+	s64 us = ktime_us_delta(now, XMM7360_SKB_CB(skb)->enqueued);
+	int bucket = us > 0 ? fls64(us) : 0;
+
+	if (bucket >= SOJOURN_BUCKETS)
+		bucket = SOJOURN_BUCKETS - 1;
+	xn->sojourn_hist[bucket]++;
+	if (us > xn->stats.sojourn_max_us)
+		xn->stats.sojourn_max_us = us;
+}
+
+static struct sk_buff *xmm7360_net_dequeue(struct xmm_net *xn)
+{
+	struct sk_buff *skb;
+
+	if (!READ_ONCE(codel)) {
+		skb = xmm7360_codel_dequeue(&xn->cvars, xn);
+	} else {
+		xn->cparams.target = US2TIME(READ_ONCE(codel_target_us));
+		xn->cparams.interval = US2TIME(READ_ONCE(codel_interval_us));
+		xn->cparams.ecn = READ_ONCE(codel_ecn);
+		xn->cparams.mtu = xn->xmm->netdev->mtu;
+		skb = codel_dequeue(xn, &xn->queued_bytes, &xn->cparams,
+				    &xn->cvars, &xn->cstats,
+				    xmm7360_codel_skb_len,
+				    xmm7360_codel_skb_time, xmm7360_codel_drop,
+				    xmm7360_codel_dequeue);
+	}
+
+	return skb;
+}
+
+/* Once the head of the queue no longer fits, look a little further back
+ * for packets that do. Flows with a packet left behind are skipped from
+ * then on, so that no flow is reordered.
+ */
+#define PACK_MAX_BLOCKED 32
+
+static int xmm7360_net_pack_lookahead(struct xmm_net *xn,
+				      struct mux_frame *frame, ktime_t now)
+{
+	u32 blocked[PACK_MAX_BLOCKED];
+	unsigned int budget = READ_ONCE(pack_lookahead);
+	struct sk_buff *skb, *tmp;
+	int n_blocked = 0, i, ret;
+	u32 hash;
+
+	skb_queue_walk_safe(&xn->queue, skb, tmp) {
+		if (!budget--)
+			break;
+
+		hash = skb_get_hash(skb);
+		for (i = 0; i < n_blocked; i++)
+			if (blocked[i] == hash)
+				break;
+		if (i < n_blocked)
+			continue;
+
+		if (!xmm7360_net_frame_fits(frame, skb)) {
+			if (n_blocked == PACK_MAX_BLOCKED)
+				break;
+			blocked[n_blocked++] = hash;
+			continue;
+		}
+
+		skb_unlink(skb, &xn->queue);
+		xn->queued_packets--;
+		xn->queued_bytes -= 16 + skb->len;
+		xmm7360_net_record_sojourn(xn, skb, now);
+
+		ret = xmm7360_mux_frame_append_packet(frame, skb);
+		dev_consume_skb_any(skb);
+		if (ret)
+			return ret;
+		xn->stats.pack_lookahead_picks++;
+	}
+
+	return 0;
+}
+
+/* Build and ship one frame from the queue. Returns the number of packets
+ * shipped; anything that did not fit stays queued for the next frame.
+ */
+static int xmm7360_net_flush(struct xmm_net *xn)
+{
+	struct sk_buff *skb;
+	struct mux_frame *frame = &xn->frame;
+	int ret;
+	u32 unknown = 0;
+	ktime_t now;
+
+	xn->overflow_packets = 0;
+
+	if (skb_queue_empty(&xn->queue))
+		return 0;
+
+	/* Leave the packets queued, and ageing, until the ring drains */
+	if (!xmm7360_qp_can_write(xn->qp))
+		return 0;
+
+	if (ack_filter)
+		xmm7360_net_ack_filter(xn);
+
+	now = ktime_get();
+	if (qlth_ab)
+		xmm7360_net_burst_begin(xn, now);
+
+	xmm7360_mux_frame_init(xn, frame, xn->sequence++);
+	xmm7360_mux_frame_add_tag(frame, 'ADBH', 0, NULL, 0);
+
+	/* A packet that does not fit an empty frame never will, and would
+	 * hold up the queue behind it for good.
+	 */
+	while ((skb = skb_peek(&xn->queue)) &&
+	       !xmm7360_net_frame_fits(frame, skb)) {
+		skb_unlink(skb, &xn->queue);
+		xn->queued_packets--;
+		xn->queued_bytes -= 16 + skb->len;
+		xn->xmm->netdev->stats.tx_dropped++;
+		dev_kfree_skb_any(skb);
+	}
+
+	while ((skb = skb_peek(&xn->queue)) &&
+	       xmm7360_net_frame_fits(frame, skb)) {
+		skb = xmm7360_net_dequeue(xn);
+		if (!skb)
+			break;
+
+		/* CoDel dropped the head; its successor may not fit */
+		if (!xmm7360_net_frame_fits(frame, skb)) {
+			xn->queued_packets++;
+			xn->queued_bytes += 16 + skb->len;
+			skb_queue_head(&xn->queue, skb);
+			break;
+		}
+
+		xmm7360_net_record_sojourn(xn, skb, now);
+		ret = xmm7360_mux_frame_append_packet(frame, skb);
+		dev_consume_skb_any(skb);
+		if (ret)
+			goto drop;
+	}
+
+	if (!skb_queue_empty(&xn->queue)) {
+		ret = xmm7360_net_pack_lookahead(xn, frame, now);
+		if (ret)
+			goto drop;
+	}
+
+	/* CoDel may have dropped everything */
+	if (!frame->n_packets)
+		return 0;
+
+	ret = xmm7360_mux_frame_add_tag(frame, 'ADTH', xn->channel, &unknown,
+					sizeof(uint32_t));
+	if (ret)
+		goto drop;
+	ret = xmm7360_mux_frame_append_data(frame, &frame->bounds[0],
+					    sizeof(struct mux_bounds) *
+						    frame->n_packets);
+	if (ret)
+		goto drop;
+	xmm7360_net_add_qlth(xn, frame, now);
+	ret = xmm7360_mux_frame_push(xn->xmm, frame);
+	if (ret)
+		goto drop;
+
+	if (qlth_ab)
+		xmm7360_net_burst_account(xn, now, frame->n_bytes);
+
+	xn->stats.tx_frames++;
+	xn->stats.tx_frame_packets += frame->n_packets;
+	xn->stats.tx_frame_bytes += frame->n_bytes;
+	xn->stats.tx_frame_unused_bytes += frame->max_size - frame->n_bytes;
+
+	return frame->n_packets;
+
+drop:
+	dev_err(xn->xmm->dev, "Failed to ship coalesced frame");
+	while ((skb = skb_dequeue(&xn->queue)))
+		dev_kfree_skb_any(skb);
+	xn->queued_packets = xn->queued_bytes = 0;
+	schedule_work(&xn->reset_work);
+	return 0;
+}
+
+static void xmm7360_net_flush_all(struct xmm_net *xn)
+{
+	while (xmm7360_net_flush(xn) > 0)
+		;
+}
+
+/* Uplink coalescing policies, see xmm7360_coalesce.h */
+
+#define XMM7360_COALESCE_DEADLINE_NS (100 * NSEC_PER_USEC)
+#define XMM7360_COALESCE_IDLE_FALLBACK_NS NSEC_PER_MSEC
+
+static LIST_HEAD(xmm7360_coalesce_list);
+static DEFINE_MUTEX(xmm7360_coalesce_mutex);
+
+bool xmm7360_coalesce_frame_full(struct xmm_net *xn, unsigned int len)
+{
+	return xmm7360_net_must_flush(xn, len);
+}
+EXPORT_SYMBOL_GPL(xmm7360_coalesce_frame_full);
+
+unsigned int xmm7360_coalesce_queued(struct xmm_net *xn)
+{
+	return xn->queued_packets;
+}
+EXPORT_SYMBOL_GPL(xmm7360_coalesce_queued);
+
+/* No frames are waiting for the modem to consume them */
+bool xmm7360_coalesce_tx_idle(struct xmm_net *xn)
+{
+	struct xmm_dev *xmm = xn->xmm;
+	u8 id = xn->qp->num * 2;
+
+	return xmm->td_ring[id].wptr == READ_ONCE(xmm->cp->s_rptr[id]);
+}
+EXPORT_SYMBOL_GPL(xmm7360_coalesce_tx_idle);
+
+void xmm7360_coalesce_flush(struct xmm_net *xn)
+{
+	xmm7360_net_flush_all(xn);
+}
+EXPORT_SYMBOL_GPL(xmm7360_coalesce_flush);
+
+static bool xmm7360_coalesce_should_flush(struct xmm_net *xn,
+					  struct sk_buff *skb)
+{
+	return xmm7360_net_must_flush(xn, skb->len);
+}
+
+static void xmm7360_coalesce_on_completion(struct xmm_net *xn)
+{
+	xmm7360_net_flush_all(xn);
+}
+
+/* Hold packets for up to 100us, or until the frame fills up */
+static s64 xmm7360_coalesce_deadline_next(struct xmm_net *xn)
+{
+	return XMM7360_COALESCE_DEADLINE_NS;
+}
+
+/* One frame per packet, for latency tests */
+static s64 xmm7360_coalesce_immediate_next(struct xmm_net *xn)
+{
+	return 0;
+}
+
+/* Send straight away when the modem has nothing in flight, otherwise
+ * collect packets until it completes a frame.
+ */
+static s64 xmm7360_coalesce_idle_next(struct xmm_net *xn)
+{
+	if (xmm7360_coalesce_tx_idle(xn))
+		return 0;
+	return XMM7360_COALESCE_IDLE_FALLBACK_NS;
+}
+
+static struct xmm7360_coalesce_ops xmm7360_coalesce_deadline = {
+	.name = "deadline",
+	.should_flush = xmm7360_coalesce_should_flush,
+	.next_deadline = xmm7360_coalesce_deadline_next,
+	.on_completion = xmm7360_coalesce_on_completion,
+};
+
+static struct xmm7360_coalesce_ops xmm7360_coalesce_immediate = {
+	.name = "immediate",
+	.should_flush = xmm7360_coalesce_should_flush,
+	.next_deadline = xmm7360_coalesce_immediate_next,
+	.on_completion = xmm7360_coalesce_on_completion,
+};
+
+static struct xmm7360_coalesce_ops xmm7360_coalesce_idle = {
+	.name = "idle",
+	.should_flush = xmm7360_coalesce_should_flush,
+	.next_deadline = xmm7360_coalesce_idle_next,
+	.on_completion = xmm7360_coalesce_on_completion,
+};
+
+int xmm7360_coalesce_register(struct xmm7360_coalesce_ops *ops)
+{
+	struct xmm7360_coalesce_ops *o;
+	int ret = 0;
+
+	if (!ops->name || !ops->should_flush || !ops->next_deadline)
+		return -EINVAL;
+
+	mutex_lock(&xmm7360_coalesce_mutex);
+	list_for_each_entry(o, &xmm7360_coalesce_list, list) {
+		if (!strcmp(o->name, ops->name)) {
+			ret = -EEXIST;
+			goto out;
+		}
+	}
+	list_add_tail(&ops->list, &xmm7360_coalesce_list);
+out:
+	mutex_unlock(&xmm7360_coalesce_mutex);
 	return ret;
 }
+EXPORT_SYMBOL_GPL(xmm7360_coalesce_register);
 
-static int xmm7360_mux_frame_push(struct xmm_dev *xmm, struct mux_frame *frame)
+/* A policy in use holds a reference on its module, so this is only ever
+ * called for one that no device has selected.
+ */
+void xmm7360_coalesce_unregister(struct xmm7360_coalesce_ops *ops)
 {
-	struct mux_first_header *hdr = (void *)&frame->data[0];
-	int ret;
-	hdr->length = frame->n_bytes;
+	mutex_lock(&xmm7360_coalesce_mutex);
+	list_del(&ops->list);
+	mutex_unlock(&xmm7360_coalesce_mutex);
+}
+EXPORT_SYMBOL_GPL(xmm7360_coalesce_unregister);
 
-	ret = xmm7360_qp_write(xmm->net->qp, frame->data, frame->n_bytes);
-	if (ret < 0)
-		return ret;
-	return 0;
+static ssize_t coalesce_policy_show(struct device *d,
+				    struct device_attribute *attr, char *buf)
+{
+	struct xmm_net *xn = netdev_priv(to_net_dev(d));
+	struct xmm7360_coalesce_ops *ops;
+	ssize_t len = 0;
+
+	mutex_lock(&xmm7360_coalesce_mutex);
+	list_for_each_entry(ops, &xmm7360_coalesce_list, list)
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 ops == READ_ONCE(xn->coalesce) ? "[%s] " :
+								  "%s ",
+				 ops->name);
+	mutex_unlock(&xmm7360_coalesce_mutex);
+
+	if (len)
+		buf[len - 1] = '\n';
+	return len;
 }
 
-static int xmm7360_mux_control(struct xmm_net *xn, u32 arg1, u32 arg2, u32 arg3,
-			       u32 arg4)
+static ssize_t coalesce_policy_store(struct device *d,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
 {
-	struct mux_frame *frame = &xn->frame;
-	int ret;
-	uint32_t cmdh_args[] = { arg1, arg2, arg3, arg4 };
+	struct xmm_net *xn = netdev_priv(to_net_dev(d));
+	const struct xmm7360_coalesce_ops *ops = NULL, *old;
+	struct xmm7360_coalesce_ops *o;
 	unsigned long flags;
 
-	spin_lock_irqsave(&xn->lock, flags);
+	mutex_lock(&xmm7360_coalesce_mutex);
+	list_for_each_entry(o, &xmm7360_coalesce_list, list) {
+		if (sysfs_streq(buf, o->name)) {
+			ops = o;
+			break;
+		}
+	}
+	if (ops && !try_module_get(ops->owner))
+		ops = NULL;
+	mutex_unlock(&xmm7360_coalesce_mutex);
 
-	xmm7360_mux_frame_init(xn, frame, 0);
-	xmm7360_mux_frame_add_tag(frame, 'ACBH', 0, NULL, 0);
-	xmm7360_mux_frame_add_tag(frame, 'CMDH', xn->channel, cmdh_args,
-				  sizeof(cmdh_args));
-	ret = xmm7360_mux_frame_push(xn->xmm, frame);
+	if (!ops)
+		return -EINVAL;
 
+	/* What the old policy was holding back goes out before the switch */
+	spin_lock_irqsave(&xn->lock, flags);
+	old = xn->coalesce;
+	if (xmm7360_qp_can_write(xn->qp))
+		xmm7360_net_flush_all(xn);
+	WRITE_ONCE(xn->coalesce, ops);
 	spin_unlock_irqrestore(&xn->lock, flags);
 
-	return ret;
+	module_put(old->owner);
+	return count;
 }
+static DEVICE_ATTR_RW(coalesce_policy);
 
-static void xmm7360_net_uninit(struct net_device *dev)
-{
-}
+static struct attribute *xmm7360_net_attrs[] = {
+	&dev_attr_coalesce_policy.attr,
+	NULL,
+};
 
-static int xmm7360_net_open(struct net_device *dev)
+static const struct attribute_group xmm7360_net_attr_group = {
+	.name = "xmm7360",
+	.attrs = xmm7360_net_attrs,
+};
+
+/* Flush the mux rings, or close and reopen them if restart is set */
+static int xmm7360_net_reset(struct xmm_net *xn, bool restart)
 {
-	struct xmm_net *xn = netdev_priv(dev);
+	struct net_device *dev = xn->xmm->netdev;
 	struct sk_buff *skb;
-	xn->queued_packets = xn->queued_bytes = 0;
+	unsigned long flags;
+	int ret;
+
+	netif_tx_disable(dev);
+	hrtimer_cancel(&xn->deadline);
+
+	if (restart)
+		ret = xmm7360_qp_restart(xn->qp);
+	else
+		ret = xmm7360_qp_reset(xn->qp);
+	if (ret)
+		dev_err(xn->xmm->dev, "mux ring reset failed: %d\n", ret);
+
+	spin_lock_irqsave(&xn->lock, flags);
 	while ((skb = skb_dequeue(&xn->queue)))
-		kfree_skb(skb);
-	netif_start_queue(dev);
-	return xmm7360_mux_control(xn, 1, 0, 0, 0);
+		dev_kfree_skb_any(skb);
+	xn->queued_packets = xn->queued_bytes = 0;
+	xn->stats.ring_resets++;
+	spin_unlock_irqrestore(&xn->lock, flags);
+
+	if (netif_running(dev))
+		netif_wake_queue(dev);
+	return ret;
 }
 
-static int xmm7360_net_close(struct net_device *dev)
+static void xmm7360_net_reset_work(struct work_struct *work)
 {
-	netif_stop_queue(dev);
-	return 0;
+	struct xmm_net *xn = container_of(work, struct xmm_net, reset_work);
+	xmm7360_net_reset(xn, false);
 }
 
-static int xmm7360_net_must_flush(struct xmm_net *xn, int new_packet_bytes)
+/* Stop the data path before the mux rings are closed for suspend */
+static void xmm7360_net_suspend(struct xmm_net *xn)
 {
-	int frame_size;
-	if (xn->queued_packets >= MUX_MAX_PACKETS)
-		return 1;
-
-	frame_size = sizeof(struct mux_first_header) + xn->queued_bytes +
-		     sizeof(struct mux_next_header) + 4 +
-		     sizeof(struct mux_bounds) * xn->queued_packets;
+	struct net_device *dev = xn->xmm->netdev;
+	struct sk_buff *skb;
+	unsigned long flags;
 
-	frame_size += 16 + new_packet_bytes + sizeof(struct mux_bounds);
+	cancel_work_sync(&xn->reset_work);
+	netif_tx_disable(dev);
+	netif_device_detach(dev);
+	hrtimer_cancel(&xn->deadline);
 
-	return frame_size > xn->frame.max_size;
+	spin_lock_irqsave(&xn->lock, flags);
+	while ((skb = skb_dequeue(&xn->queue)))
+		dev_kfree_skb_any(skb);
+	xn->queued_packets = xn->queued_bytes = 0;
+	spin_unlock_irqrestore(&xn->lock, flags);
 }
 
-static void xmm7360_net_flush(struct xmm_net *xn)
+static void xmm7360_net_resume(struct xmm_net *xn, u64 resume_us)
 {
-	struct sk_buff *skb;
-	struct mux_frame *frame = &xn->frame;
-	int ret;
-	u32 unknown = 0;
-
-	if (skb_queue_empty(&xn->queue))
-		return;
+	struct net_device *dev = xn->xmm->netdev;
+	unsigned long flags;
 
-	xmm7360_mux_frame_init(xn, frame, xn->sequence++);
-	xmm7360_mux_frame_add_tag(frame, 'ADBH', 0, NULL, 0);
+	spin_lock_irqsave(&xn->lock, flags);
+	xn->stats.resumes++;
+	xn->stats.resume_us = resume_us;
+	spin_unlock_irqrestore(&xn->lock, flags);
 
-	while ((skb = skb_dequeue(&xn->queue))) {
-		ret = xmm7360_mux_frame_append_packet(frame, skb);
-		if (ret)
-			goto drop;
-	}
+	netif_device_attach(dev);
+	if (netif_running(dev))
+		xmm7360_mux_control(xn, 1, 0, 0, 0);
+}
 
-	ret = xmm7360_mux_frame_add_tag(frame, 'ADTH', xn->channel, &unknown,
-					sizeof(uint32_t));
-	if (ret)
-		goto drop;
-	ret = xmm7360_mux_frame_append_data(frame, &frame->bounds[0],
-					    sizeof(struct mux_bounds) *
-						    frame->n_packets);
-	if (ret)
-		goto drop;
-	ret = xmm7360_mux_frame_push(xn->xmm, frame);
-	if (ret)
-		goto drop;
+/* First data frame from the modem since the last resume */
+static void xmm7360_net_note_traffic(struct xmm_net *xn)
+{
+	struct xmm_dev *xmm = xn->xmm;
+	u64 us = ktime_us_delta(ktime_get(), xmm->resume_start);
 
-	xn->queued_packets = xn->queued_bytes = 0;
+	WRITE_ONCE(xmm->awaiting_traffic, false);
 
-	return;
+	spin_lock(&xn->lock);
+	xn->stats.resume_to_traffic_us = us;
+	spin_unlock(&xn->lock);
 
-drop:
-	dev_err(xn->xmm->dev, "Failed to ship coalesced frame");
+	dev_info(xmm->dev, "traffic resumed %llu us after wakeup\n", us);
 }
 
 static enum hrtimer_restart xmm7360_net_deadline_cb(struct hrtimer *t)
@@ -960,7 +3270,7 @@ static enum hrtimer_restart xmm7360_net_deadline_cb(struct hrtimer *t)
 	struct xmm_net *xn = container_of(t, struct xmm_net, deadline);
 	unsigned long flags;
 	spin_lock_irqsave(&xn->lock, flags);
-	xmm7360_net_flush(xn);
+	xmm7360_net_flush_all(xn);
 	spin_unlock_irqrestore(&xn->lock, flags);
 	return HRTIMER_NORESTART;
 }
@@ -968,17 +3278,28 @@ static enum hrtimer_restart xmm7360_net_deadline_cb(struct hrtimer *t)
 static netdev_tx_t xmm7360_net_xmit(struct sk_buff *skb, struct net_device *dev)
 {
 	struct xmm_net *xn = netdev_priv(dev);
-	ktime_t kt;
+	const struct xmm7360_coalesce_ops *ops;
 	unsigned long flags;
+	s64 delay;
 
 	if (netif_queue_stopped(dev))
 		return NETDEV_TX_BUSY;
 
+	if (skb->len > dev->mtu) {
+		dev->stats.tx_dropped++;
+		dev_kfree_skb_any(skb);
+		return NETDEV_TX_OK;
+	}
+
 	skb_orphan(skb);
 
 	spin_lock_irqsave(&xn->lock, flags);
-	if (xmm7360_net_must_flush(xn, skb->len)) {
-		if (xmm7360_qp_can_write(xn->qp)) {
+	ops = xn->coalesce;
+	if (ops->should_flush(xn, skb)) {
+		if (xn->overflow_packets < READ_ONCE(pack_lookahead)) {
+			/* Queue past the frame to give the packer a choice */
+			xn->overflow_packets++;
+		} else if (xmm7360_qp_can_write(xn->qp)) {
 			xmm7360_net_flush(xn);
 		} else {
 			netif_stop_queue(dev);
@@ -989,20 +3310,28 @@ static netdev_tx_t xmm7360_net_xmit(struct sk_buff *skb, struct net_device *dev)
 
 	xn->queued_packets++;
 	xn->queued_bytes += 16 + skb->len;
+	XMM7360_SKB_CB(skb)->enqueued = ktime_get();
+	XMM7360_SKB_CB(skb)->ack_counted = false;
 	skb_queue_tail(&xn->queue, skb);
+	if (ops->enqueue)
+		ops->enqueue(xn, skb);
+
+	delay = ops->next_deadline(xn);
+	if (!delay && xmm7360_qp_can_write(xn->qp))
+		xmm7360_net_flush_all(xn);
 
 	spin_unlock_irqrestore(&xn->lock, flags);
 
-	if (!hrtimer_active(&xn->deadline)) {
-		kt = ktime_set(0, 100000);
-		hrtimer_start(&xn->deadline, kt, HRTIMER_MODE_REL);
-	}
+	if (delay > 0 && !hrtimer_active(&xn->deadline))
+		hrtimer_start(&xn->deadline, ns_to_ktime(delay),
+			      HRTIMER_MODE_REL);
 
 	return NETDEV_TX_OK;
 }
 
 static void xmm7360_net_mux_handle_frame(struct xmm_net *xn, u8 *data, int len)
 {
+	struct net_device *dev = xn->xmm->netdev;
 	struct mux_first_header *first;
 	struct mux_next_header *adth;
 	int n_packets, i;
@@ -1012,6 +3341,10 @@ static void xmm7360_net_mux_handle_frame(struct xmm_net *xn, u8 *data, int len)
 	u8 ip_version;
 
 	first = (void *)data;
+	if (len < sizeof(*first)) {
+		dev->stats.rx_length_errors++;
+		return;
+	}
 	if (ntohl(first->tag) == 'ACBH')
 		return;
 
@@ -1020,68 +3353,482 @@ static void xmm7360_net_mux_handle_frame(struct xmm_net *xn, u8 *data, int len)
 		return;
 	}
 
-	adth = (void *)(&data[first->next]);
-	if (ntohl(adth->tag) != 'ADTH') {
-		dev_err(xn->xmm->dev, "Unexpected tag %x, expected ADTH\n",
-			adth->tag);
-		return;
+	if (first->next > len - sizeof(struct mux_next_header)) {
+		dev->stats.rx_length_errors++;
+		return;
+	}
+	adth = (void *)(&data[first->next]);
+	if (ntohl(adth->tag) != 'ADTH') {
+		dev_err(xn->xmm->dev, "Unexpected tag %x, expected ADTH\n",
+			adth->tag);
+		return;
+	}
+
+	/* The bounds table has to lie within the frame as well */
+	if (adth->length < sizeof(struct mux_next_header) + 4 ||
+	    adth->length > len - first->next) {
+		dev->stats.rx_length_errors++;
+		return;
+	}
+	n_packets = (adth->length - sizeof(struct mux_next_header) - 4) /
+		    sizeof(struct mux_bounds);
+
+	bounds =
+		(void *)&data[first->next + sizeof(struct mux_next_header) + 4];
+
+	if (unlikely(READ_ONCE(xn->xmm->awaiting_traffic)) && n_packets > 0)
+		xmm7360_net_note_traffic(xn);
+
+	for (i = 0; i < n_packets; i++) {
+		if (!bounds[i].length)
+			continue;
+
+		if (bounds[i].length > len ||
+		    bounds[i].offset > len - bounds[i].length) {
+			dev->stats.rx_length_errors++;
+			continue;
+		}
+
+		skb = netdev_alloc_skb_ip_align(dev, bounds[i].length);
+		if (!skb) {
+			dev->stats.rx_dropped++;
+			return;
+		}
+		p = skb_put(skb, bounds[i].length);
+		memcpy(p, &data[bounds[i].offset], bounds[i].length);
+
+		ip_version = skb->data[0] >> 4;
+		if (ip_version == 4) {
+			skb->protocol = htons(ETH_P_IP);
+		} else if (ip_version == 6) {
+			skb->protocol = htons(ETH_P_IPV6);
+		} else {
+			kfree_skb(skb);
+			return;
+		}
+
+		netif_rx(skb);
+	}
+}
+
+static void xmm7360_net_poll(struct xmm_dev *xmm)
+{
+	struct queue_pair *qp;
+	struct td_ring *ring;
+	int idx, nread;
+	u8 rptr;
+	if (!xmm->net)
+		return;
+	qp = xmm->net->qp;
+	ring = &xmm->td_ring[qp->num * 2 + 1];
+
+	if (!skb_queue_empty(&xmm->net->queue) && xmm7360_qp_can_write(qp)) {
+		/* Whatever xmit or the deadline timer could not send for
+		 * lack of ring space goes out now, unless the policy wants
+		 * to decide that itself.
+		 */
+		spin_lock(&xmm->net->lock);
+		if (xmm->net->coalesce->on_completion)
+			xmm->net->coalesce->on_completion(xmm->net);
+		else
+			xmm7360_net_flush_all(xmm->net);
+		spin_unlock(&xmm->net->lock);
+	}
+
+	if (netif_queue_stopped(xmm->netdev) && xmm7360_qp_can_write(qp))
+		netif_wake_queue(xmm->netdev);
+
+	if (!ring->depth)
+		return;
+
+	/* Drain whatever has completed, then hand the TDs back in one go */
+	while ((rptr = xmm7360_td_ring_rptr(xmm, qp->num * 2 + 1)) !=
+	       ring->last_handled) {
+		do {
+			idx = ring->last_handled;
+			nread = ring->tds[idx].length;
+			/* The modem writes the length; don't trust it */
+			xmm7360_net_mux_handle_frame(xmm->net, ring->pages[idx],
+						     min_t(int, nread,
+							   ring->page_size));
+			xmm7360_td_ring_account(ring, nread);
+			xmm7360_td_ring_read(xmm, qp->num * 2 + 1);
+			ring->last_handled = (idx + 1) & (ring->depth - 1);
+		} while (ring->last_handled != rptr);
+
+		xmm7360_td_ring_publish(xmm, qp->num * 2 + 1);
+		xmm7360_ding(xmm, DOORBELL_TD);
+	}
+}
+
+#define XMM_NET_STAT(name, member)                                             \
+	{                                                                      \
+		name, offsetof(struct xmm_net_stats, member)                   \
+	}
+
+static const struct {
+	char name[ETH_GSTRING_LEN];
+	size_t offset;
+} xmm7360_net_stats_desc[] = {
+	XMM_NET_STAT("qlth_tags", qlth_tags),
+	XMM_NET_STAT("qlth_ab_off_bursts", qlth_ab_bursts[0]),
+	XMM_NET_STAT("qlth_ab_off_ramp_us", qlth_ab_ramp_us[0]),
+	XMM_NET_STAT("qlth_ab_on_bursts", qlth_ab_bursts[1]),
+	XMM_NET_STAT("qlth_ab_on_ramp_us", qlth_ab_ramp_us[1]),
+	XMM_NET_STAT("ack_filter_acks", ack_filter_acks),
+	XMM_NET_STAT("ack_filter_dropped", ack_filter_dropped),
+	XMM_NET_STAT("codel_drops", codel_drops),
+	XMM_NET_STAT("codel_ecn_marks", codel_ecn_marks),
+	XMM_NET_STAT("sojourn_p50_us", sojourn_p50_us),
+	XMM_NET_STAT("sojourn_p90_us", sojourn_p90_us),
+	XMM_NET_STAT("sojourn_p99_us", sojourn_p99_us),
+	XMM_NET_STAT("sojourn_max_us", sojourn_max_us),
+	XMM_NET_STAT("tx_frames", tx_frames),
+	XMM_NET_STAT("tx_frame_packets", tx_frame_packets),
+	XMM_NET_STAT("tx_frame_bytes", tx_frame_bytes),
+	XMM_NET_STAT("tx_frame_unused_bytes", tx_frame_unused_bytes),
+	XMM_NET_STAT("pack_lookahead_picks", pack_lookahead_picks),
+	XMM_NET_STAT("ring_resets", ring_resets),
+	XMM_NET_STAT("resumes", resumes),
+	XMM_NET_STAT("resume_us", resume_us),
+	XMM_NET_STAT("resume_to_traffic_us", resume_to_traffic_us),
+	XMM_NET_STAT("tx_timeouts", tx_timeouts),
+	XMM_NET_STAT("wd_tx_stalls", wd_tx_stalls),
+	XMM_NET_STAT("wd_lost_irqs", wd_lost_irqs),
+	XMM_NET_STAT("wd_rx_rearms", wd_rx_rearms),
+	XMM_NET_STAT("wd_ring_flushes", wd_ring_flushes),
+	XMM_NET_STAT("wd_qp_restarts", wd_qp_restarts),
+	XMM_NET_STAT("wd_dev_reinits", wd_dev_reinits),
+};
+
+#define XMM_NET_N_STATS ARRAY_SIZE(xmm7360_net_stats_desc)
+
+static u64 xmm7360_sojourn_percentile(struct xmm_net *xn, int pct)
+{
+	u64 total = 0, seen = 0;
+	int i;
+
+	for (i = 0; i < SOJOURN_BUCKETS; i++)
+		total += xn->sojourn_hist[i];
+	if (!total)
+		return 0;
+
+	for (i = 0; i < SOJOURN_BUCKETS; i++) {
+		seen += xn->sojourn_hist[i];
+		if (seen * 100 >= total * pct)
+			break;
+	}
+	return 1ULL << i;
+}
+
+/* Fill in the statistics that are derived rather than counted */
+static void xmm7360_net_update_stats(struct xmm_net *xn)
+{
+	struct xmm_dev *xmm = xn->xmm;
+
+	xn->stats.codel_drops = xn->cstats.drop_count;
+	xn->stats.codel_ecn_marks = xn->cstats.ecn_mark;
+	xn->stats.sojourn_p50_us = xmm7360_sojourn_percentile(xn, 50);
+	xn->stats.sojourn_p90_us = xmm7360_sojourn_percentile(xn, 90);
+	xn->stats.sojourn_p99_us = xmm7360_sojourn_percentile(xn, 99);
+	xn->stats.wd_tx_stalls = xmm->wd_stats.tx_stalls;
+	xn->stats.wd_lost_irqs = xmm->wd_stats.lost_irqs;
+	xn->stats.wd_rx_rearms = xmm->wd_stats.rx_rearms;
+	xn->stats.wd_ring_flushes = xmm->wd_stats.ring_flushes;
+	xn->stats.wd_qp_restarts = xmm->wd_stats.qp_restarts;
+	xn->stats.wd_dev_reinits = xmm->wd_stats.dev_reinits;
+}
+
+static void xmm7360_get_drvinfo(struct net_device *dev,
+				struct ethtool_drvinfo *info)
+{
+	struct xmm_net *xn = netdev_priv(dev);
+
+	strscpy(info->driver, "xmm7360", sizeof(info->driver));
+	strscpy(info->bus_info, pci_name(xn->xmm->pci_dev),
+		sizeof(info->bus_info));
+}
+
+enum {
+	XMM_TEST_RESULT,
+	XMM_TEST_FRAMES,
+	XMM_TEST_FPS,
+	XMM_TEST_CONSUME_AVG,
+	XMM_TEST_CONSUME_MAX,
+	XMM_TEST_IRQ_AVG,
+	XMM_TEST_IRQS,
+	XMM_TEST_N
+};
+
+static const char xmm7360_test_names[XMM_TEST_N][ETH_GSTRING_LEN] = {
+	[XMM_TEST_RESULT] = "ring test (0=pass)",
+	[XMM_TEST_FRAMES] = "frames completed",
+	[XMM_TEST_FPS] = "frames per second",
+	[XMM_TEST_CONSUME_AVG] = "doorbell to consume avg (ns)",
+	[XMM_TEST_CONSUME_MAX] = "doorbell to consume max (ns)",
+	[XMM_TEST_IRQ_AVG] = "doorbell to irq avg (ns)",
+	[XMM_TEST_IRQS] = "irqs seen",
+};
+
+static int xmm7360_get_sset_count(struct net_device *dev, int sset)
+{
+	switch (sset) {
+	case ETH_SS_STATS:
+		return XMM_NET_N_STATS;
+	case ETH_SS_TEST:
+		return XMM_TEST_N;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static void xmm7360_get_strings(struct net_device *dev, u32 sset, u8 *data)
+{
+	int i;
+
+	switch (sset) {
+	case ETH_SS_STATS:
+		for (i = 0; i < XMM_NET_N_STATS; i++)
+			memcpy(data + i * ETH_GSTRING_LEN,
+			       xmm7360_net_stats_desc[i].name, ETH_GSTRING_LEN);
+		break;
+	case ETH_SS_TEST:
+		memcpy(data, xmm7360_test_names, sizeof(xmm7360_test_names));
+		break;
+	}
+}
+
+static void xmm7360_get_ethtool_stats(struct net_device *dev,
+				      struct ethtool_stats *stats, u64 *data)
+{
+	struct xmm_net *xn = netdev_priv(dev);
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&xn->lock, flags);
+	xmm7360_net_update_stats(xn);
+	for (i = 0; i < XMM_NET_N_STATS; i++)
+		data[i] = *(u64 *)((u8 *)&xn->stats +
+				   xmm7360_net_stats_desc[i].offset);
+	spin_unlock_irqrestore(&xn->lock, flags);
+}
+
+static int xmm7360_ethtool_reset(struct net_device *dev, u32 *flags)
+{
+	struct xmm_net *xn = netdev_priv(dev);
+
+	if (!(*flags & ETH_RESET_DMA))
+		return -EOPNOTSUPP;
+
+	xmm7360_net_reset(xn, false);
+	*flags &= ~ETH_RESET_DMA;
+	return 0;
+}
+
+/* Wait for the modem to consume everything on a Tx ring. Completion
+ * interrupts are not reliable enough to time, so poll the read pointer;
+ * the self-test runs under rtnl, so sleep between polls rather than spin.
+ */
+static int xmm7360_selftest_drain(struct xmm_dev *xmm, u8 ring_id,
+				  unsigned int ms)
+{
+	struct td_ring *ring = &xmm->td_ring[ring_id];
+	ktime_t deadline = ktime_add_ms(ktime_get(), ms);
+
+	while (ring->wptr != xmm7360_td_ring_rptr(xmm, ring_id)) {
+		if (READ_ONCE(xmm->error) || ktime_after(ktime_get(), deadline))
+			return -ETIMEDOUT;
+		usleep_range(10, 20);
+	}
+	return 0;
+}
+
+/* Push mux command frames through the Tx ring, first one at a time to
+ * time the doorbell to consume and doorbell to interrupt paths, then back
+ * to back for throughput. The frames re-send the channel open command the
+ * driver already issues on open and resume, so the modem state is left
+ * as it was.
+ */
+static int xmm7360_selftest_run(struct xmm_net *xn, u64 *data)
+{
+	struct xmm_dev *xmm = xn->xmm;
+	struct queue_pair *qp = xn->qp;
+	u8 ring_id = qp->num * 2;
+	unsigned int frames = clamp(READ_ONCE(selftest_frames), 1U,
+				    SELFTEST_MAX_FRAMES);
+	u64 consume_sum = 0, irq_sum = 0;
+	ktime_t start, done;
+	unsigned int i, sent;
+	s64 ns;
+	int ret;
+
+	for (i = 0; i < frames; i++) {
+		WRITE_ONCE(xmm->selftest_armed, true);
+		start = ktime_get();
+		ret = xmm7360_mux_control(xn, 1, 0, 0, 0);
+		if (ret)
+			return ret;
+		ret = xmm7360_selftest_drain(xmm, ring_id, 100);
+		if (ret)
+			return ret;
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		consume_sum += ns;
+		data[XMM_TEST_CONSUME_MAX] = max_t(u64,
+						   data[XMM_TEST_CONSUME_MAX],
+						   ns);
+
+		/* The interrupt may trail the consume by a little; irq0
+		 * disarms and wakes xmm->wq.
+		 */
+		if (wait_event_timeout(xmm->wq,
+				       !READ_ONCE(xmm->selftest_armed),
+				       msecs_to_jiffies(10))) {
+			irq_sum += ktime_to_ns(ktime_sub(xmm->selftest_irq,
+							 start));
+			data[XMM_TEST_IRQS]++;
+		}
+	}
+	WRITE_ONCE(xmm->selftest_armed, false);
+
+	data[XMM_TEST_CONSUME_AVG] = div_u64(consume_sum, frames);
+	if (data[XMM_TEST_IRQS])
+		data[XMM_TEST_IRQ_AVG] = div64_u64(irq_sum,
+						   data[XMM_TEST_IRQS]);
+
+	start = ktime_get();
+	done = ktime_add_ms(start, 1000);
+	for (sent = 0; sent < frames;) {
+		if (!xmm7360_qp_can_write(qp)) {
+			if (READ_ONCE(xmm->error) ||
+			    ktime_after(ktime_get(), done))
+				return -ETIMEDOUT;
+			usleep_range(10, 20);
+			continue;
+		}
+		ret = xmm7360_mux_control(xn, 1, 0, 0, 0);
+		if (ret)
+			return ret;
+		sent++;
+	}
+	ret = xmm7360_selftest_drain(xmm, ring_id, 1000);
+	if (ret)
+		return ret;
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	data[XMM_TEST_FRAMES] = frames;
+	data[XMM_TEST_FPS] = div64_u64((u64)frames * NSEC_PER_SEC,
+				       max_t(s64, ns, 1));
+	return 0;
+}
+
+static void xmm7360_self_test(struct net_device *dev,
+			      struct ethtool_test *test, u64 *data)
+{
+	struct xmm_net *xn = netdev_priv(dev);
+	struct xmm_dev *xmm = xn->xmm;
+	unsigned long flags;
+	ktime_t deadline;
+	bool idle;
+	int ret;
+
+	memset(data, 0, XMM_TEST_N * sizeof(*data));
+
+	if (!netif_running(dev)) {
+		netdev_err(dev, "self-test needs the interface up\n");
+		ret = -ENETDOWN;
+		goto out;
+	}
+
+	ret = xmm7360_pm_get(xmm);
+	if (ret)
+		goto out;
+
+	/* Take the ring away from the stack and let it drain */
+	netif_tx_disable(dev);
+	hrtimer_cancel(&xn->deadline);
+
+	deadline = ktime_add_ms(ktime_get(), 1000);
+	for (;;) {
+		spin_lock_irqsave(&xn->lock, flags);
+		xmm7360_net_flush_all(xn);
+		idle = !xmm7360_coalesce_queued(xn) &&
+		       xmm7360_coalesce_tx_idle(xn);
+		spin_unlock_irqrestore(&xn->lock, flags);
+		if (idle)
+			break;
+		if (READ_ONCE(xmm->error) ||
+		    ktime_after(ktime_get(), deadline)) {
+			ret = -ETIMEDOUT;
+			break;
+		}
+		usleep_range(100, 200);
 	}
 
-	n_packets = (adth->length - sizeof(struct mux_next_header) - 4) /
-		    sizeof(struct mux_bounds);
+	if (!ret)
+		ret = xmm7360_selftest_run(xn, data);
 
-	bounds =
-		(void *)&data[first->next + sizeof(struct mux_next_header) + 4];
+	netif_wake_queue(dev);
+	xmm7360_pm_put(xmm);
 
-	for (i = 0; i < n_packets; i++) {
-		if (!bounds[i].length)
-			continue;
+	if (!ret)
+		netdev_info(dev,
+			    "self-test: %llu frames, %llu/s, consume avg %llu max %llu ns, irq avg %llu ns (%llu seen)\n",
+			    data[XMM_TEST_FRAMES], data[XMM_TEST_FPS],
+			    data[XMM_TEST_CONSUME_AVG],
+			    data[XMM_TEST_CONSUME_MAX], data[XMM_TEST_IRQ_AVG],
+			    data[XMM_TEST_IRQS]);
+out:
+	if (ret) {
+		netdev_err(dev, "self-test failed: %d\n", ret);
+		data[XMM_TEST_RESULT] = 1;
+		test->flags |= ETH_TEST_FL_FAILED;
+	}
+}
 
-		skb = dev_alloc_skb(bounds[i].length + NET_IP_ALIGN);
-		if (!skb)
-			return;
-		skb_reserve(skb, NET_IP_ALIGN);
-		p = skb_put(skb, bounds[i].length);
-		memcpy(p, &data[bounds[i].offset], bounds[i].length);
+static const struct ethtool_ops xmm7360_ethtool_ops = {
+	.get_drvinfo = xmm7360_get_drvinfo,
+	.reset = xmm7360_ethtool_reset,
+	.get_link = ethtool_op_get_link,
+	.get_sset_count = xmm7360_get_sset_count,
+	.get_strings = xmm7360_get_strings,
+	.get_ethtool_stats = xmm7360_get_ethtool_stats,
+	.self_test = xmm7360_self_test,
+};
 
-		skb->dev = xn->xmm->netdev;
+static int xmm7360_net_change_mtu(struct net_device *dev, int new_mtu)
+{
+	struct xmm_net *xn = netdev_priv(dev);
+	unsigned long flags;
 
-		ip_version = skb->data[0] >> 4;
-		if (ip_version == 4) {
-			skb->protocol = htons(ETH_P_IP);
-		} else if (ip_version == 6) {
-			skb->protocol = htons(ETH_P_IPV6);
-		} else {
-			kfree_skb(skb);
-			return;
-		}
+	/* Frames already queued were sized against the old MTU */
+	spin_lock_irqsave(&xn->lock, flags);
+	xmm7360_net_flush_all(xn);
+	WRITE_ONCE(dev->mtu, new_mtu);
+	spin_unlock_irqrestore(&xn->lock, flags);
 
-		netif_rx(skb);
-	}
+	return 0;
 }
 
-static void xmm7360_net_poll(struct xmm_dev *xmm)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+static void xmm7360_net_tx_timeout(struct net_device *dev,
+				   unsigned int txqueue)
+#else
+static void xmm7360_net_tx_timeout(struct net_device *dev)
+#endif
 {
-	struct queue_pair *qp;
-	struct td_ring *ring;
-	int idx, nread;
-	if (!xmm->net)
-		return;
-	qp = xmm->net->qp;
-	ring = &xmm->td_ring[qp->num * 2 + 1];
-
-	if (netif_queue_stopped(xmm->netdev) && xmm7360_qp_can_write(qp))
-		netif_wake_queue(xmm->netdev);
+	struct xmm_net *xn = netdev_priv(dev);
+	struct xmm_dev *xmm = xn->xmm;
+	unsigned long flags;
 
-	while (xmm7360_qp_has_data(qp)) {
-		idx = ring->last_handled;
-		nread = ring->tds[idx].length;
-		xmm7360_net_mux_handle_frame(xmm->net, ring->pages[idx], nread);
+	spin_lock_irqsave(&xn->lock, flags);
+	xn->stats.tx_timeouts++;
+	spin_unlock_irqrestore(&xn->lock, flags);
 
-		xmm7360_td_ring_read(xmm, qp->num * 2 + 1);
-		xmm7360_ding(xmm, DOORBELL_TD);
-		ring->last_handled = (idx + 1) & (ring->depth - 1);
-	}
+	/* Let the watchdog escalate straight away rather than at its next
+	 * check; it can sleep, we can't.
+	 */
+	WRITE_ONCE(xmm->wd_tx_timeout, true);
+	if (READ_ONCE(xmm->wd_enabled))
+		mod_delayed_work(system_wq, &xmm->wd_work, 0);
 }
 
 static const struct net_device_ops xmm7360_netdev_ops = {
@@ -1089,6 +3836,8 @@ static const struct net_device_ops xmm7360_netdev_ops = {
 	.ndo_open = xmm7360_net_open,
 	.ndo_stop = xmm7360_net_close,
 	.ndo_start_xmit = xmm7360_net_xmit,
+	.ndo_change_mtu = xmm7360_net_change_mtu,
+	.ndo_tx_timeout = xmm7360_net_tx_timeout,
 };
 
 static void xmm7360_net_setup(struct net_device *dev)
@@ -1098,16 +3847,19 @@ static void xmm7360_net_setup(struct net_device *dev)
 	hrtimer_init(&xn->deadline, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
 	xn->deadline.function = xmm7360_net_deadline_cb;
 	skb_queue_head_init(&xn->queue);
+	INIT_WORK(&xn->reset_work, xmm7360_net_reset_work);
 
 	dev->netdev_ops = &xmm7360_netdev_ops;
+	dev->ethtool_ops = &xmm7360_ethtool_ops;
 
 	dev->hard_header_len = 0;
 	dev->addr_len = 0;
 	dev->mtu = 1500;
-	dev->min_mtu = 1500;
+	dev->min_mtu = ETH_MIN_MTU;
 	dev->max_mtu = 1500;
 
 	dev->tx_queue_len = 1000;
+	dev->watchdog_timeo = 2 * HZ;
 
 	dev->type = ARPHRD_NONE;
 	dev->flags = IFF_POINTOPOINT | IFF_NOARP | IFF_MULTICAST;
@@ -1133,31 +3885,54 @@ static int xmm7360_create_net(struct xmm_dev *xmm)
 	xn->xmm = xmm;
 	xmm->net = xn;
 
+	xn->qp = xmm7360_init_qp(xmm, 0, 128, TD_MAX_PAGE_SIZE);
+	netdev->max_mtu =
+		xn->qp->page_size - MUX_FRAME_OVERHEAD - MUX_QLTH_SIZE;
+
+	xn->coalesce = &xmm7360_coalesce_deadline;
+	netdev->sysfs_groups[0] = &xmm7360_net_attr_group;
+
+	xn->frame.data = kmalloc_node(xn->qp->page_size, GFP_KERNEL,
+				      dev_to_node(xmm->dev));
+	if (!xn->frame.data) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
 	rtnl_lock();
 	ret = register_netdevice(netdev);
 	rtnl_unlock();
+	if (ret)
+		goto fail;
 
-	xn->qp = xmm7360_init_qp(xmm, 0, 128, TD_MAX_PAGE_SIZE);
-
-	if (!ret)
-		ret = xmm7360_qp_start(xn->qp);
-
-	if (ret < 0) {
-		free_netdev(netdev);
-		xmm->netdev = NULL;
-		xmm7360_qp_stop(xn->qp);
+	ret = xmm7360_qp_start(xn->qp);
+	if (ret) {
+		rtnl_lock();
+		unregister_netdevice(netdev);
+		rtnl_unlock();
+		goto fail;
 	}
 
+	return 0;
+
+fail:
+	kfree(xn->frame.data);
+	free_netdev(netdev);
+	xmm->net = NULL;
+	xmm->netdev = NULL;
 	return ret;
 }
 
 static void xmm7360_destroy_net(struct xmm_dev *xmm)
 {
 	if (xmm->netdev) {
+		cancel_work_sync(&xmm->net->reset_work);
 		xmm7360_qp_stop(xmm->net->qp);
 		rtnl_lock();
 		unregister_netdevice(xmm->netdev);
 		rtnl_unlock();
+		module_put(xmm->net->coalesce->owner);
+		kfree(xmm->net->frame.data);
 		free_netdev(xmm->netdev);
 		xmm->net = NULL;
 		xmm->netdev = NULL;
@@ -1170,14 +3945,38 @@ static irqreturn_t xmm7360_irq0(int irq, void *dev_id)
 	struct queue_pair *qp;
 	int id;
 
+	xmm->irqs++;
+
+	/* While suspended only command completions are of interest, and the
+	 * status registers may read back garbage.
+	 */
+	if (READ_ONCE(xmm->quiesced)) {
+		wake_up(&xmm->wq);
+		return IRQ_HANDLED;
+	}
+
+	if (unlikely(READ_ONCE(xmm->selftest_armed))) {
+		xmm->selftest_irq = ktime_get();
+		WRITE_ONCE(xmm->selftest_armed, false);
+	}
+
 	xmm7360_poll(xmm);
 	wake_up(&xmm->wq);
+
+	/* Leaving the ready state always goes through xmm->error */
+	if ((xmm->error && xmm->last_state == XMM_STATE_READY) ||
+	    xmm->cp->status.asleep != xmm->last_asleep)
+		xmm7360_state_changed(xmm);
+
 	if (xmm->td_ring) {
 		xmm7360_net_poll(xmm);
 
 		for (id = 1; id < 8; id++) {
 			qp = &xmm->qp[id];
 
+			if (qp->open && id == 1)
+				xmm7360_rpc_poll_qp(qp);
+
 			/* wake _cdev_read() */
 			if (qp->open)
 				wake_up(&qp->wq);
@@ -1204,21 +4003,48 @@ static irqreturn_t xmm7360_irq0(int irq, void *dev_id)
 	return IRQ_HANDLED;
 }
 
+static void xmm7360_wd_start(struct xmm_dev *xmm)
+{
+	unsigned int period = READ_ONCE(watchdog_ms);
+
+	WRITE_ONCE(xmm->wd_enabled, true);
+	if (period)
+		schedule_delayed_work(&xmm->wd_work, msecs_to_jiffies(period));
+}
+
+static void xmm7360_wd_stop(struct xmm_dev *xmm)
+{
+	WRITE_ONCE(xmm->wd_enabled, false);
+	cancel_delayed_work_sync(&xmm->wd_work);
+}
+
 static void xmm7360_dev_deinit(struct xmm_dev *xmm)
 {
 	int i;
 	xmm->error = -ENODEV;
 
 	cancel_work_sync(&xmm->init_work);
+	xmm7360_wd_stop(xmm);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 4, 0)
+	if (xmm->state_ready)
+		sysfs_remove_groups(&xmm->dev->kobj, xmm7360_groups);
+#endif
+	WRITE_ONCE(xmm->state_ready, false);
 
 	xmm7360_destroy_net(xmm);
+	/* A Tx timeout may have kicked the watchdog in the meantime */
+	cancel_delayed_work_sync(&xmm->wd_work);
+	cancel_work_sync(&xmm->state_work);
 
 	for (i = 0; i < 8; i++) {
 		if (xmm->qp[i].xmm) {
+			cancel_delayed_work_sync(&xmm->qp[i].free_work);
 			if (xmm->qp[i].cdev.owner) {
 				cdev_del(&xmm->qp[i].cdev);
 				device_unregister(&xmm->qp[i].dev);
 			}
+			kfree(xmm->qp[i].user_buf);
 			if (xmm->qp[i].port.ops) {
 				tty_unregister_device(xmm7360_tty_driver,
 						      xmm->qp[i].tty_index);
@@ -1227,6 +4053,8 @@ static void xmm7360_dev_deinit(struct xmm_dev *xmm)
 		}
 		memset(&xmm->qp[i], 0, sizeof(struct queue_pair));
 	}
+	for (i = 0; i < 16; i++)
+		xmm7360_td_ring_free(xmm, i);
 	xmm7360_cmd_ring_free(xmm);
 }
 
@@ -1234,10 +4062,18 @@ static void xmm7360_remove(struct pci_dev *dev)
 {
 	struct xmm_dev *xmm = pci_get_drvdata(dev);
 
+	if (xmm->runtime_pm) {
+		pm_runtime_forbid(&dev->dev);
+		pm_runtime_get_noresume(&dev->dev);
+		pm_runtime_dont_use_autosuspend(&dev->dev);
+	}
+
 	xmm7360_dev_deinit(xmm);
 
-	if (xmm->irq)
+	if (xmm->irq) {
+		irq_set_affinity_hint(xmm->irq, NULL);
 		free_irq(xmm->irq, xmm);
+	}
 	pci_free_irq_vectors(dev);
 	pci_release_region(dev, 0);
 	pci_release_region(dev, 2);
@@ -1306,13 +4142,22 @@ static int xmm7360_tty_port_activate(struct tty_port *tport,
 				     struct tty_struct *tty)
 {
 	struct queue_pair *qp = tty->driver_data;
-	return xmm7360_qp_start(qp);
+	int ret;
+
+	ret = xmm7360_pm_get(qp->xmm);
+	if (ret)
+		return ret;
+	ret = xmm7360_qp_start(qp);
+	if (ret)
+		xmm7360_pm_put(qp->xmm);
+	return ret;
 }
 
 static void xmm7360_tty_port_shutdown(struct tty_port *tport)
 {
 	struct queue_pair *qp = tport->tty->driver_data;
 	xmm7360_qp_stop(qp);
+	xmm7360_pm_put(qp->xmm);
 }
 
 static const struct tty_port_operations xmm7360_tty_port_ops = {
@@ -1356,6 +4201,11 @@ static int xmm7360_create_cdev(struct xmm_dev *xmm, int num, const char *name,
 	struct queue_pair *qp = xmm7360_init_qp(xmm, num, 16, TD_MAX_PAGE_SIZE);
 	int ret;
 
+	qp->user_buf =
+		kmalloc_node(qp->page_size, GFP_KERNEL, dev_to_node(xmm->dev));
+	if (!qp->user_buf)
+		return -ENOMEM;
+
 	cdev_init(&qp->cdev, &xmm7360_fops);
 	qp->cdev.owner = THIS_MODULE;
 	device_initialize(&qp->dev);
@@ -1372,13 +4222,10 @@ static int xmm7360_create_cdev(struct xmm_dev *xmm, int num, const char *name,
 	return 0;
 }
 
-static int xmm7360_dev_init(struct xmm_dev *xmm)
+static int xmm7360_wait_ready(struct xmm_dev *xmm)
 {
-	int ret, i;
 	u32 status;
-
-	xmm->error = 0;
-	xmm->num_ttys = 0;
+	int i;
 
 	status = xmm->bar2[0];
 	if (status == 0xfeedb007) {
@@ -1397,6 +4244,19 @@ static int xmm7360_dev_init(struct xmm_dev *xmm)
 	}
 
 	dev_info(xmm->dev, "modem is ready");
+	return 0;
+}
+
+static int xmm7360_dev_init(struct xmm_dev *xmm)
+{
+	int ret;
+
+	xmm->error = 0;
+	xmm->num_ttys = 0;
+
+	ret = xmm7360_wait_ready(xmm);
+	if (ret)
+		return ret;
 
 	ret = xmm7360_cmd_ring_init(xmm);
 	if (ret) {
@@ -1432,19 +4292,308 @@ void xmm7360_dev_init_work(struct work_struct *work)
 	xmm7360_dev_init(xmm);
 }
 
-static int xmm7360_probe(struct pci_dev *dev, const struct pci_device_id *id)
+/* Close every open ring but leave the queue pairs marked open, with their
+ * ring memory cached, so that resume only has to reopen them.
+ */
+static int xmm7360_pm_quiesce(struct xmm_dev *xmm)
+{
+	struct queue_pair *qp;
+	int i;
+
+	if (xmm->quiesced)
+		return 0;
+
+	/* From here on the IRQ handler and the Tx path keep off the rings */
+	WRITE_ONCE(xmm->quiesced, true);
+
+	if (xmm->net)
+		xmm7360_net_suspend(xmm->net);
+
+	for (i = 0; i < 8; i++) {
+		qp = &xmm->qp[i];
+		if (!qp->xmm)
+			continue;
+		mutex_lock(&qp->lock);
+		if (qp->open)
+			xmm7360_qp_close_rings(qp);
+		mutex_unlock(&qp->lock);
+	}
+
+	xmm->bar0[BAR0_MODE] = 0;
+	xmm7360_state_changed(xmm);
+	return 0;
+}
+
+static int xmm7360_pm_restore(struct xmm_dev *xmm)
+{
+	ktime_t start = ktime_get();
+	struct queue_pair *qp;
+	u64 resume_us;
+	int i, ret;
+
+	if (!xmm->quiesced)
+		return 0;
+
+	ret = xmm7360_wait_ready(xmm);
+	if (ret)
+		goto fail;
+
+	xmm->error = 0;
+	ret = xmm7360_cmd_ring_init(xmm);
+	if (ret)
+		goto fail;
+
+	for (i = 0; i < 8; i++) {
+		qp = &xmm->qp[i];
+		if (!qp->xmm)
+			continue;
+		mutex_lock(&qp->lock);
+		if (qp->open)
+			ret = xmm7360_qp_open_rings(qp);
+		mutex_unlock(&qp->lock);
+		if (ret) {
+			dev_err(xmm->dev, "could not reopen qp %d: %d\n", i,
+				ret);
+			goto fail;
+		}
+	}
+
+	WRITE_ONCE(xmm->quiesced, false);
+
+	resume_us = ktime_us_delta(ktime_get(), start);
+	xmm->resume_start = start;
+	WRITE_ONCE(xmm->awaiting_traffic, true);
+	if (xmm->net)
+		xmm7360_net_resume(xmm->net, resume_us);
+
+	dev_info(xmm->dev, "resumed in %llu us\n", resume_us);
+	xmm7360_state_changed(xmm);
+	return 0;
+
+fail:
+	dev_err(xmm->dev, "modem did not come back from suspend: %d\n", ret);
+	xmm->error = -ENODEV;
+	xmm7360_state_changed(xmm);
+	return ret;
+}
+
+static void xmm7360_wd_recover(struct xmm_dev *xmm, struct queue_pair *qp)
+{
+	static const char *const names[] = { "flushed", "restarted",
+					     "reinitialised device" };
+	struct xmm_net *xn = xmm->net;
+	bool is_net = xn && qp == xn->qp;
+	int action = qp->wd_level;
+	int i, ret;
+
+	switch (action) {
+	case XMM7360_WD_FLUSH:
+		xmm->wd_stats.ring_flushes++;
+		if (is_net)
+			ret = xmm7360_net_reset(xn, false);
+		else
+			ret = xmm7360_cdev_qp_reset(qp, false);
+		break;
+	case XMM7360_WD_QP_RESTART:
+		xmm->wd_stats.qp_restarts++;
+		if (is_net)
+			ret = xmm7360_net_reset(xn, true);
+		else
+			ret = xmm7360_cdev_qp_reset(qp, true);
+		break;
+	default:
+		xmm->wd_stats.dev_reinits++;
+		xmm7360_pm_quiesce(xmm);
+		ret = xmm7360_pm_restore(xmm);
+		break;
+	}
+
+	trace_xmm7360_wd_action(xmm->card_num, qp->num, action, ret);
+	dev_warn(xmm->dev, "qp %d Tx ring stalled, %s: %d\n", qp->num,
+		 names[action], ret);
+
+	/* A fresh device starts over from the cheapest recovery */
+	if (action == XMM7360_WD_DEV_REINIT) {
+		for (i = 0; i < 8; i++)
+			xmm->qp[i].wd_level = XMM7360_WD_FLUSH;
+	} else {
+		qp->wd_level++;
+	}
+	qp->wd_tx_rptr = READ_ONCE(xmm->cp->s_rptr[qp->num * 2]);
+	qp->wd_tx_since = jiffies;
+}
+
+/* Recover a Tx ring the modem has stopped consuming. A ring that makes any
+ * progress between checks drops back to the first escalation level.
+ */
+static void xmm7360_wd_check_tx(struct xmm_dev *xmm, struct queue_pair *qp,
+				unsigned long stall, bool force)
+{
+	int id = qp->num * 2;
+	u32 wptr = xmm->td_ring[id].wptr;
+	u32 rptr = READ_ONCE(xmm->cp->s_rptr[id]);
+
+	if (rptr != qp->wd_tx_rptr) {
+		qp->wd_tx_rptr = rptr;
+		qp->wd_tx_since = jiffies;
+		qp->wd_level = XMM7360_WD_FLUSH;
+		return;
+	}
+
+	if (!force) {
+		if (wptr == rptr) {
+			qp->wd_tx_since = jiffies;
+			return;
+		}
+		if (time_before(jiffies, qp->wd_tx_since + stall))
+			return;
+	}
+
+	xmm->wd_stats.tx_stalls++;
+	trace_xmm7360_ring_stall(xmm->card_num, id, wptr, rptr,
+				 jiffies_to_msecs(jiffies - qp->wd_tx_since));
+	xmm7360_wd_recover(xmm, qp);
+}
+
+/* The mux Rx ring is drained from the IRQ handler, so completed TDs left
+ * sitting across a whole period mean an interrupt went missing.
+ */
+static void xmm7360_wd_check_rx(struct xmm_dev *xmm, struct queue_pair *qp)
+{
+	int id = qp->num * 2 + 1;
+	struct td_ring *ring = &xmm->td_ring[id];
+	unsigned long flags;
+
+	if (xmm7360_qp_has_data(qp)) {
+		if (qp->wd_rx_pending &&
+		    ring->last_handled == qp->wd_rx_handled) {
+			xmm->wd_stats.lost_irqs++;
+			trace_xmm7360_wd_action(xmm->card_num, qp->num,
+						XMM7360_WD_LOST_IRQ, 0);
+			/* Run the handler as it would run for a real IRQ; the
+			 * locks it takes are also taken from the deadline
+			 * hrtimer, so local interrupts have to be off too.
+			 */
+			disable_irq(xmm->irq);
+			local_bh_disable();
+			local_irq_save(flags);
+			xmm7360_irq0(xmm->irq, xmm);
+			local_irq_restore(flags);
+			local_bh_enable();
+			enable_irq(xmm->irq);
+			qp->wd_rx_pending = false;
+		} else {
+			qp->wd_rx_pending = true;
+			qp->wd_rx_handled = ring->last_handled;
+		}
+		return;
+	}
+	qp->wd_rx_pending = false;
+
+	/* Nothing pending and nothing handed to the modem to receive into */
+	mutex_lock(&qp->lock);
+	if (ring->depth && ring->wptr == READ_ONCE(xmm->cp->s_rptr[id])) {
+		xmm->wd_stats.rx_rearms++;
+		trace_xmm7360_wd_action(xmm->card_num, qp->num,
+					XMM7360_WD_RX_REARM, 0);
+		disable_irq(xmm->irq);
+		while (!xmm7360_td_ring_full(xmm, id))
+			xmm7360_td_ring_read(xmm, id);
+		xmm7360_td_ring_publish(xmm, id);
+		enable_irq(xmm->irq);
+		xmm7360_ding(xmm, DOORBELL_TD);
+	}
+	mutex_unlock(&qp->lock);
+}
+
+static void xmm7360_wd_work(struct work_struct *work)
+{
+	struct xmm_dev *xmm =
+		container_of(to_delayed_work(work), struct xmm_dev, wd_work);
+	unsigned int period = READ_ONCE(watchdog_ms);
+	unsigned long stall = msecs_to_jiffies(2 * period);
+	bool tx_timeout = READ_ONCE(xmm->wd_tx_timeout);
+	struct queue_pair *qp;
+	bool is_net;
+	int i, pm;
+
+	WRITE_ONCE(xmm->wd_tx_timeout, false);
+
+	/* Don't wake an idle modem just to look at it */
+	pm = pm_runtime_get_if_in_use(xmm->dev);
+	if (!pm)
+		goto out;
+
+	for (i = 0; i < 8 && !READ_ONCE(xmm->quiesced); i++) {
+		qp = &xmm->qp[i];
+		if (!qp->xmm || !qp->open)
+			continue;
+		is_net = xmm->net && qp == xmm->net->qp;
+		if (is_net)
+			xmm7360_wd_check_rx(xmm, qp);
+		/* Only mux and RPC are known to complete every TD; the tty
+		 * ports may leave writes unconsumed for good, and recovering
+		 * them would only reset the device over and over.
+		 */
+		if (is_net || qp->num == 1)
+			xmm7360_wd_check_tx(xmm, qp, stall,
+					    is_net && tx_timeout);
+	}
+
+	if (pm > 0)
+		pm_runtime_put_autosuspend(xmm->dev);
+out:
+	if (period && READ_ONCE(xmm->wd_enabled))
+		schedule_delayed_work(&xmm->wd_work, msecs_to_jiffies(period));
+}
+
+static int __maybe_unused xmm7360_suspend(struct device *dev)
+{
+	struct xmm_dev *xmm = dev_get_drvdata(dev);
+
+	xmm7360_wd_stop(xmm);
+	return xmm7360_pm_quiesce(xmm);
+}
+
+static int __maybe_unused xmm7360_resume(struct device *dev)
 {
-	struct xmm_dev *xmm = kzalloc(sizeof(struct xmm_dev), GFP_KERNEL);
+	struct xmm_dev *xmm = dev_get_drvdata(dev);
 	int ret;
 
-	xmm->pci_dev = dev;
-	xmm->dev = &dev->dev;
+	ret = xmm7360_pm_restore(xmm);
+	if (!ret)
+		xmm7360_wd_start(xmm);
+	return ret;
+}
+
+static const struct dev_pm_ops xmm7360_pm_ops = {
+	SET_SYSTEM_SLEEP_PM_OPS(xmm7360_suspend, xmm7360_resume)
+	SET_RUNTIME_PM_OPS(xmm7360_suspend, xmm7360_resume, NULL)
+};
 
+static int xmm7360_probe(struct pci_dev *dev, const struct pci_device_id *id)
+{
+	int node = dev_to_node(&dev->dev);
+	struct xmm_dev *xmm;
+	int ret;
+
+	xmm = kzalloc_node(sizeof(struct xmm_dev), GFP_KERNEL, node);
 	if (!xmm) {
 		dev_err(&(dev->dev), "kzalloc\n");
 		return -ENOMEM;
 	}
 
+	xmm->pci_dev = dev;
+	xmm->dev = &dev->dev;
+
+	/* Every failure below goes through dev_deinit, which flushes these */
+	init_waitqueue_head(&xmm->wq);
+	INIT_WORK(&xmm->init_work, xmm7360_dev_init_work);
+	INIT_DELAYED_WORK(&xmm->wd_work, xmm7360_wd_work);
+	INIT_WORK(&xmm->state_work, xmm7360_state_work);
+	xmm7360_rpc_init(&xmm->rpc);
+	pci_set_drvdata(dev, xmm);
+
 	ret = pci_enable_device(dev);
 	if (ret) {
 		dev_err(&(dev->dev), "pci_enable_device\n");
@@ -1478,21 +4627,44 @@ static int xmm7360_probe(struct pci_dev *dev, const struct pci_device_id *id)
 		goto fail;
 	}
 
-	init_waitqueue_head(&xmm->wq);
-	INIT_WORK(&xmm->init_work, xmm7360_dev_init_work);
-
-	xmm->irq = pci_irq_vector(dev, 0);
-	ret = request_irq(xmm->irq, xmm7360_irq0, 0, "xmm7360", xmm);
+	ret = request_irq(pci_irq_vector(dev, 0), xmm7360_irq0, 0, "xmm7360",
+			  xmm);
 	if (ret) {
 		dev_err(&(dev->dev), "request_irq\n");
 		goto fail;
 	}
+	xmm->irq = pci_irq_vector(dev, 0);
 
-	pci_set_drvdata(dev, xmm);
+	/* Rx and the IRQ-side Tx flush run in the handler, so steering the
+	 * IRQ to the device's node keeps them next to the rings.
+	 */
+	if (node != NUMA_NO_NODE)
+		irq_set_affinity_hint(xmm->irq, cpumask_of_node(node));
 
 	ret = xmm7360_dev_init(xmm);
-	if (!ret)
+	if (!ret) {
+		/* The PCI core holds a runtime PM reference across probe */
+		if (autosuspend_ms >= 0) {
+			pm_runtime_set_autosuspend_delay(&dev->dev,
+							 autosuspend_ms);
+			pm_runtime_use_autosuspend(&dev->dev);
+			pm_runtime_mark_last_busy(&dev->dev);
+			pm_runtime_put_noidle(&dev->dev);
+			pm_runtime_allow(&dev->dev);
+			xmm->runtime_pm = true;
+		}
+		xmm7360_wd_start(xmm);
+
+		xmm->last_state = xmm7360_state(xmm);
+		xmm->last_asleep = xmm7360_asleep(xmm);
+		xmm->last_qp_open = xmm7360_qp_open_mask(xmm);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 4, 0)
+		if (sysfs_create_groups(&dev->dev.kobj, xmm7360_groups))
+			dev_warn(xmm->dev, "could not create sysfs attributes\n");
+#endif
+		WRITE_ONCE(xmm->state_ready, true);
 		return 0;
+	}
 
 fail:
 	xmm7360_dev_deinit(xmm);
@@ -1505,12 +4677,20 @@ static struct pci_driver xmm7360_driver = {
 	.id_table = xmm7360_ids,
 	.probe = xmm7360_probe,
 	.remove = xmm7360_remove,
+	.driver.pm = &xmm7360_pm_ops,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+	.driver.dev_groups = xmm7360_groups,
+#endif
 };
 
 static int xmm7360_init(void)
 {
 	int ret;
 
+	xmm7360_coalesce_register(&xmm7360_coalesce_deadline);
+	xmm7360_coalesce_register(&xmm7360_coalesce_immediate);
+	xmm7360_coalesce_register(&xmm7360_coalesce_idle);
+
 	ret = alloc_chrdev_region(&xmm_base, 0, 8, "xmm");
 	if (ret) {
 		return ret;
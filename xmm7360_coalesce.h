@@ -0,0 +1,66 @@
+// vim: noet ts=8 sts=8 sw=8
+/*
+ * Uplink coalescing policies for the XMM7360 mux network device.
+ *
+ * Copyright (c) 2020 genua GmbH <info@genua.de>
+ * Copyright (c) 2020 James Wah <james@laird-wah.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES ON
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGE
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _XMM7360_COALESCE_H
+#define _XMM7360_COALESCE_H
+
+#include <linux/list.h>
+#include <linux/types.h>
+
+struct module;
+struct sk_buff;
+struct xmm_net;
+
+/* A policy decides when queued uplink packets are packed into a mux frame
+ * and handed to the modem. Every hook is called with the mux Tx lock held,
+ * from xmit, the deadline timer or the IRQ handler, so none may sleep.
+ *
+ * The policy for a device is chosen by writing its name to
+ * /sys/class/net/<dev>/xmm7360/coalesce_policy.
+ */
+struct xmm7360_coalesce_ops {
+	struct list_head list;
+	const char *name;
+	struct module *owner;
+
+	/* The frame being built must go out before skb is queued */
+	bool (*should_flush)(struct xmm_net *xn, struct sk_buff *skb);
+	/* Optional: skb has just been queued */
+	void (*enqueue)(struct xmm_net *xn, struct sk_buff *skb);
+	/* Nanoseconds until the queue must be flushed. 0 flushes now, a
+	 * negative value leaves it to on_completion.
+	 */
+	s64 (*next_deadline)(struct xmm_net *xn);
+	/* Optional: the modem has interrupted with the Tx ring writable and
+	 * packets queued. Without it the whole queue is flushed.
+	 */
+	void (*on_completion)(struct xmm_net *xn);
+};
+
+int xmm7360_coalesce_register(struct xmm7360_coalesce_ops *ops);
+void xmm7360_coalesce_unregister(struct xmm7360_coalesce_ops *ops);
+
+/* For use by policies, with the Tx lock held */
+bool xmm7360_coalesce_frame_full(struct xmm_net *xn, unsigned int len);
+unsigned int xmm7360_coalesce_queued(struct xmm_net *xn);
+bool xmm7360_coalesce_tx_idle(struct xmm_net *xn);
+void xmm7360_coalesce_flush(struct xmm_net *xn);
+
+#endif /* _XMM7360_COALESCE_H */
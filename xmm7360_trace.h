@@ -0,0 +1,90 @@
+// vim: noet ts=8 sts=8 sw=8
+/*
+ * Tracepoints for the XMM7360 ring watchdog.
+ *
+ * Copyright (c) 2020 genua GmbH <info@genua.de>
+ * Copyright (c) 2020 James Wah <james@laird-wah.net>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES ON
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGE
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM xmm7360
+
+#if !defined(_XMM7360_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _XMM7360_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// Watchdog actions, in escalation order
+#define XMM7360_WD_FLUSH 0
+#define XMM7360_WD_QP_RESTART 1
+#define XMM7360_WD_DEV_REINIT 2
+#define XMM7360_WD_LOST_IRQ 3
+#define XMM7360_WD_RX_REARM 4
+
+#define show_wd_action(action)                                                 \
+	__print_symbolic(action, { XMM7360_WD_FLUSH, "flush" },                \
+			 { XMM7360_WD_QP_RESTART, "qp_restart" },              \
+			 { XMM7360_WD_DEV_REINIT, "dev_reinit" },              \
+			 { XMM7360_WD_LOST_IRQ, "lost_irq" },                  \
+			 { XMM7360_WD_RX_REARM, "rx_rearm" })
+
+TRACE_EVENT(xmm7360_ring_stall,
+	TP_PROTO(int card, int ring, u32 wptr, u32 rptr, unsigned int ms),
+	TP_ARGS(card, ring, wptr, rptr, ms),
+	TP_STRUCT__entry(
+		__field(int, card)
+		__field(int, ring)
+		__field(u32, wptr)
+		__field(u32, rptr)
+		__field(unsigned int, ms)
+	),
+	TP_fast_assign(
+		__entry->card = card;
+		__entry->ring = ring;
+		__entry->wptr = wptr;
+		__entry->rptr = rptr;
+		__entry->ms = ms;
+	),
+	TP_printk("xmm%d ring %d wptr %u rptr %u stalled %u ms",
+		  __entry->card, __entry->ring, __entry->wptr, __entry->rptr,
+		  __entry->ms)
+);
+
+TRACE_EVENT(xmm7360_wd_action,
+	TP_PROTO(int card, int qp, int action, int ret),
+	TP_ARGS(card, qp, action, ret),
+	TP_STRUCT__entry(
+		__field(int, card)
+		__field(int, qp)
+		__field(int, action)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->card = card;
+		__entry->qp = qp;
+		__entry->action = action;
+		__entry->ret = ret;
+	),
+	TP_printk("xmm%d qp %d %s ret %d", __entry->card, __entry->qp,
+		  show_wd_action(__entry->action), __entry->ret)
+);
+
+#endif /* _XMM7360_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE xmm7360_trace
+#include <trace/define_trace.h>